@@ -69,28 +69,11 @@ bool Guard::can_see_player(GameMode *gm) {
 
     vec3 mp = object->transform->position;
     vec2 mp2 = vec2(mp.x, mp.y);
-    vec2 point = pp2 - mp2;
-
-    // Distance of vector between player and guard
-    float dist = length(point);
-    float angle = acos(dot(point, vec2_from_dir(move_dir)) / dist);
-    if (angle < radians(22.5f) && dist < 2.5f) {
-        // Need to do some raycasts
-        auto is_in_wall = [gm](vec2 pos) {
-            int x = int(round(pos.x));
-            int y = int(round(pos.y));
-            return x < 0 || x >= MAP_WIDTH || y < 0 || y >= MAP_WIDTH || gm->walls[x][y];
-        };
-
-        for(float i = 0.f; i < 1.f; i += 0.1f) {
-            if(is_in_wall(mp2 + point * i)) {
-                return false;
-            }
-        }
+    vec2 dir = vec2_from_dir(move_dir);
 
-        return true;
-    }
-    return false;
+    // What the guard sees (within 22.5 degrees of ahead and 2.5 units, up to the walls) is kept per cell and direction:
+    VisibilityPolygon const &seen = gm->visibility.lookup(mp2, atan2(dir.y, dir.x), radians(22.5f), 2.5f);
+    return seen.contains(pp2);
 }
 
 
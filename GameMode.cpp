@@ -13,18 +13,33 @@
 #include "load_save_png.hpp"
 #include "texture_program.hpp"
 #include "depth_program.hpp"
+#include "deferred_light_program.hpp"
+#include "spot_decal_program.hpp"
 #include "Enemy.hpp"
+#include "maze_mesh.hpp"
+#include "uniform_blocks.hpp"
+#include "SpatialIndex.hpp"
+#include "light_tiles.hpp"
+#include "post_chain.hpp"
 
 #include <glm/gtc/type_ptr.hpp>
+#include <glm/gtc/matrix_transform.hpp>
 
 #include <iostream>
 #include <fstream>
 #include <map>
+#include <set>
 #include <cstddef>
 #include <random>
+#include <algorithm>
+#include <limits>
 #include <stdio.h>
 
 
+//walls span this range of heights (and a unit square in x and y):
+const float WallBottom = 0.5f;
+const float WallTop = 1.5f;
+
 Load< MeshBuffer > meshes(LoadTagDefault, [](){
 	return new MeshBuffer(data_path("maze.pnct"));
 });
@@ -37,6 +52,29 @@ Load< GLuint > meshes_for_depth_program(LoadTagDefault, [](){
 	return new GLuint(meshes->make_vao_for_program(depth_program->program));
 });
 
+//instanced programs get their per-instance attributes from Scene::draw:
+static std::set< GLuint > const instance_locations{
+	Scene::InstanceObjectToClipLocation,
+	Scene::InstanceObjectToLightLocation,
+	Scene::InstanceNormalToLightLocation
+};
+
+Load< GLuint > meshes_for_texture_program_instanced(LoadTagDefault, [](){
+	return new GLuint(meshes->make_vao_for_program(texture_program_instanced->program, instance_locations));
+});
+
+Load< GLuint > meshes_for_depth_program_instanced(LoadTagDefault, [](){
+	return new GLuint(meshes->make_vao_for_program(depth_program_instanced->program, instance_locations));
+});
+
+Load< GLuint > meshes_for_texture_program_gbuffer(LoadTagDefault, [](){
+	return new GLuint(meshes->make_vao_for_program(texture_program_gbuffer->program));
+});
+
+Load< GLuint > meshes_for_texture_program_gbuffer_instanced(LoadTagDefault, [](){
+	return new GLuint(meshes->make_vao_for_program(texture_program_gbuffer_instanced->program, instance_locations));
+});
+
 //used for fullscreen passes:
 Load< GLuint > empty_vao(LoadTagDefault, [](){
 	GLuint vao = 0;
@@ -46,42 +84,40 @@ Load< GLuint > empty_vao(LoadTagDefault, [](){
 	return new GLuint(vao);
 });
 
+//post-processing effect (see GameMode::post_chain) that blurs the edges of the screen:
 Load< GLuint > blur_program(LoadTagDefault, [](){
 	GLuint program = compile_program(
-		//this draws a triangle that covers the entire screen:
-		"#version 330\n"
-		"void main() {\n"
-		"	gl_Position = vec4(4 * (gl_VertexID & 1) - 1,  2 * (gl_VertexID & 2) - 1, 0.0, 1.0);\n"
-		"}\n"
+		PostChain::vertex_shader
 		,
 		//NOTE on reading screen texture:
 		//texelFetch() gives direct pixel access with integer coordinates, but accessing out-of-bounds pixel is undefined:
 		//	vec4 color = texelFetch(tex, ivec2(gl_FragCoord.xy), 0);
 		//texture() requires using [0,1] coordinates, but handles out-of-bounds more gracefully (using wrap settings of underlying texture):
-		//	vec4 color = texture(tex, gl_FragCoord.xy / textureSize(tex,0));
+		//	vec4 color = texture(tex, texCoord);
 
 		"#version 330\n"
 		"uniform sampler2D tex;\n"
+		"in vec2 texCoord;\n"
 		"out vec4 fragColor;\n"
 		"void main() {\n"
-		"	vec2 at = (gl_FragCoord.xy - 0.5 * textureSize(tex, 0)) / textureSize(tex, 0).y;\n"
+		"	vec2 size = vec2(textureSize(tex, 0));\n"
+		"	vec2 at = (texCoord - 0.5) * size / size.y;\n"
 		//make blur amount more near the edges and less in the middle:
-		"	float amt = (0.01 * textureSize(tex,0).y) * max(0.0,(length(at) - 0.3)/0.2);\n"
+		"	float amt = (0.01 * size.y) * max(0.0,(length(at) - 0.3)/0.2);\n"
 		//pick a vector to move in for blur using function inspired by:
 		//https://stackoverflow.com/questions/12964279/whats-the-origin-of-this-glsl-rand-one-liner
 		"	vec2 ofs = amt * normalize(vec2(\n"
 		"		fract(dot(gl_FragCoord.xy ,vec2(12.9898,78.233))),\n"
 		"		fract(dot(gl_FragCoord.xy ,vec2(96.3869,-27.5796)))\n"
 		"	));\n"
-		"   ofs = vec2(0,0);"
 		//do a four-pixel average to blur:
 		"	vec4 blur =\n"
-		"		+ 0.25 * texture(tex, (gl_FragCoord.xy + vec2(ofs.x,ofs.y)) / textureSize(tex, 0))\n"
-		"		+ 0.25 * texture(tex, (gl_FragCoord.xy + vec2(-ofs.y,ofs.x)) / textureSize(tex, 0))\n"
-		"		+ 0.25 * texture(tex, (gl_FragCoord.xy + vec2(-ofs.x,-ofs.y)) / textureSize(tex, 0))\n"
-		"		+ 0.25 * texture(tex, (gl_FragCoord.xy + vec2(ofs.y,-ofs.x)) / textureSize(tex, 0))\n"
+		"		+ 0.25 * texture(tex, texCoord + vec2(ofs.x,ofs.y) / size)\n"
+		"		+ 0.25 * texture(tex, texCoord + vec2(-ofs.y,ofs.x) / size)\n"
+		"		+ 0.25 * texture(tex, texCoord + vec2(-ofs.x,-ofs.y) / size)\n"
+		"		+ 0.25 * texture(tex, texCoord + vec2(ofs.y,-ofs.x) / size)\n"
 		"	;\n"
-		"	fragColor = vec4(blur.rgb, 1.0);\n" //blur;\n"
+		"	fragColor = vec4(blur.rgb, 1.0);\n"
 		"}\n"
 	);
 
@@ -146,8 +182,7 @@ Scene::Lamp *spot = nullptr;
 
 void GameMode::new_level() {
 
-	scene.~Scene();
-	new(&scene) Scene();
+	scene.clear();
 
 	//pre-build some program info (material) blocks to assign to each object:
 	Scene::Object::ProgramInfo texture_program_info;
@@ -156,11 +191,44 @@ void GameMode::new_level() {
 	texture_program_info.mvp_mat4  = texture_program->object_to_clip_mat4;
 	texture_program_info.mv_mat4x3 = texture_program->object_to_light_mat4x3;
 	texture_program_info.itmv_mat3 = texture_program->normal_to_light_mat3;
+	texture_program_info.instanced_program = texture_program_instanced->program;
+	texture_program_info.instanced_vao = *meshes_for_texture_program_instanced;
 
 	Scene::Object::ProgramInfo depth_program_info;
 	depth_program_info.program = depth_program->program;
 	depth_program_info.vao = *meshes_for_depth_program;
 	depth_program_info.mvp_mat4  = depth_program->object_to_clip_mat4;
+	depth_program_info.instanced_program = depth_program_instanced->program;
+	depth_program_info.instanced_vao = *meshes_for_depth_program_instanced;
+
+	Scene::Object::ProgramInfo gbuffer_program_info;
+	gbuffer_program_info.program = texture_program_gbuffer->program;
+	gbuffer_program_info.vao = *meshes_for_texture_program_gbuffer;
+	gbuffer_program_info.mvp_mat4  = texture_program_gbuffer->object_to_clip_mat4;
+	gbuffer_program_info.mv_mat4x3 = texture_program_gbuffer->object_to_light_mat4x3;
+	gbuffer_program_info.itmv_mat3 = texture_program_gbuffer->normal_to_light_mat3;
+	gbuffer_program_info.instanced_program = texture_program_gbuffer_instanced->program;
+	gbuffer_program_info.instanced_vao = *meshes_for_texture_program_gbuffer_instanced;
+
+	//set an object's programs to draw a mesh with a texture (through Scene::set_program, so the render queues get re-sorted):
+	auto set_mesh_programs = [this,&texture_program_info,&depth_program_info,&gbuffer_program_info](Scene::Object *object, MeshBuffer::Mesh const &mesh, GLuint tex) {
+		Scene::Object::ProgramInfo info = texture_program_info;
+		info.textures[0] = tex;
+		info.start = mesh.start;
+		info.count = mesh.count;
+		scene.set_program(object, Scene::Object::ProgramTypeDefault, info);
+
+		info = depth_program_info;
+		info.start = mesh.start;
+		info.count = mesh.count;
+		scene.set_program(object, Scene::Object::ProgramTypeShadow, info);
+
+		info = gbuffer_program_info;
+		info.textures[0] = tex;
+		info.start = mesh.start;
+		info.count = mesh.count;
+		scene.set_program(object, Scene::Object::ProgramTypeGBuffer, info);
+	};
 	
 	{ // Create the camera
 		camera_parent_transform = scene.new_transform();
@@ -187,18 +255,10 @@ void GameMode::new_level() {
 		player_pos->scale = vec3(0.5f,0.5f,0.5f);
 		camera_parent_transform->set_parent(player_pos);
 
-		player->programs[Scene::Object::ProgramTypeDefault] = texture_program_info;
-		player->programs[Scene::Object::ProgramTypeDefault].textures[0] = *marble_tex;
-		
-
-		player->programs[Scene::Object::ProgramTypeShadow] = depth_program_info;
-
 		MeshBuffer::Mesh const &mesh = meshes->lookup("Cube");
-		player->programs[Scene::Object::ProgramTypeDefault].start = mesh.start;
-		player->programs[Scene::Object::ProgramTypeDefault].count = mesh.count;
+		set_mesh_programs(player, mesh, *marble_tex);
 
-		player->programs[Scene::Object::ProgramTypeShadow].start = mesh.start;
-		player->programs[Scene::Object::ProgramTypeShadow].count = mesh.count;
+		player->set_bounds(mesh.min, mesh.max);
 	}
 
 	{ // Reset the map
@@ -274,49 +334,62 @@ void GameMode::new_level() {
 	{ // Add objects for walls
 		objects.clear();
 
-		for(int i=0; i<MAP_WIDTH; i++) {
-			for(int j=0; j<MAP_HEIGHT; j++) {
-				if (walls[i][j]) {
-					Scene::Object *obj = scene.new_object(scene.new_transform());
-					objects.push_back(obj);
-					obj->transform->position = vec3(i,j,1);
-					// Scale a little bit to prevent edges
-					obj->transform->scale = vec3(1.001f, 1.001f, 1.f);
-
-					obj->programs[Scene::Object::ProgramTypeDefault] = texture_program_info;
-					obj->programs[Scene::Object::ProgramTypeDefault].textures[0] = *wood_tex;
-					
-
-					obj->programs[Scene::Object::ProgramTypeShadow] = depth_program_info;
-
-					MeshBuffer::Mesh const &mesh = meshes->lookup("Cube");
-					obj->programs[Scene::Object::ProgramTypeDefault].start = mesh.start;
-					obj->programs[Scene::Object::ProgramTypeDefault].count = mesh.count;
-
-					obj->programs[Scene::Object::ProgramTypeShadow].start = mesh.start;
-					obj->programs[Scene::Object::ProgramTypeShadow].count = mesh.count;
-				}
+		// Only the exposed faces of the walls are meshed (merged into large quads), one cell tall on top of the floor:
+		Scene::Object::ProgramInfo wall_programs[Scene::Object::ProgramTypes];
+		wall_programs[Scene::Object::ProgramTypeDefault] = texture_program_info;
+		wall_programs[Scene::Object::ProgramTypeDefault].textures[0] = *wood_tex;
+		wall_programs[Scene::Object::ProgramTypeShadow] = depth_program_info;
+		wall_programs[Scene::Object::ProgramTypeGBuffer] = gbuffer_program_info;
+		wall_programs[Scene::Object::ProgramTypeGBuffer].textures[0] = *wood_tex;
+
+		build_maze_mesh(uvec2(MAP_WIDTH, MAP_HEIGHT), [this](uint32_t x, uint32_t y) {
+			return walls[x][y];
+		}, WallBottom, WallTop, *meshes, &walls_batch);
+		objects.push_back(scene.new_batch_object(&walls_batch, *meshes, wall_programs));
+
+		// Walls are also kept for visibility polygons:
+		visibility.set_walls(uvec2(MAP_WIDTH, MAP_HEIGHT), [this](uint32_t x, uint32_t y) {
+			return walls[x][y];
+		});
+
+		// ...and as a texture, one texel per cell (for WallShadowGrid):
+		std::vector< uint8_t > wall_data(MAP_WIDTH * MAP_HEIGHT);
+		for (uint32_t y = 0; y < MAP_HEIGHT; ++y) {
+			for (uint32_t x = 0; x < MAP_WIDTH; ++x) {
+				wall_data[y * MAP_WIDTH + x] = (walls[x][y] ? 0xff : 0x00);
 			}
 		}
+		if (wall_tex == 0) {
+			glGenTextures(1, &wall_tex);
+			glBindTexture(GL_TEXTURE_2D, wall_tex);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		} else {
+			glBindTexture(GL_TEXTURE_2D, wall_tex);
+		}
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_R8, MAP_WIDTH, MAP_HEIGHT, 0, GL_RED, GL_UNSIGNED_BYTE, wall_data.data());
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+		glBindTexture(GL_TEXTURE_2D, 0);
+		GL_ERRORS();
 
 		// Add floor
 		Scene::Object *obj = scene.new_object(scene.new_transform());
-		objects.push_back(obj);
 		obj->transform->position = vec3(MAP_WIDTH/2.f - 0.5f, MAP_HEIGHT/2.f - 0.5f, 0.f);
 		obj->transform->scale = vec3(MAP_WIDTH, MAP_HEIGHT, 1.f);
 
-		obj->programs[Scene::Object::ProgramTypeDefault] = texture_program_info;
-		obj->programs[Scene::Object::ProgramTypeDefault].textures[0] = *marble_tex;
-		
-
-		obj->programs[Scene::Object::ProgramTypeShadow] = depth_program_info;
-
 		MeshBuffer::Mesh const &mesh = meshes->lookup("Cube");
-		obj->programs[Scene::Object::ProgramTypeDefault].start = mesh.start;
-		obj->programs[Scene::Object::ProgramTypeDefault].count = mesh.count;
+		set_mesh_programs(obj, mesh, *marble_tex);
+
+		obj->set_bounds(mesh.min, mesh.max);
+		floor_height = obj->transform->position.z + mesh.max.z * obj->transform->scale.z; //(for light decals)
 
-		obj->programs[Scene::Object::ProgramTypeShadow].start = mesh.start;
-		obj->programs[Scene::Object::ProgramTypeShadow].count = mesh.count;
+		// The floor never moves, so bake it into a world-space batch:
+		Scene::Transform *floor_transform = obj->transform;
+		objects.push_back(scene.bake({ obj }, *meshes, &floor_batch, 0.0f));
+		scene.delete_transform(floor_transform);
 	}
 
 	{ // Create goal
@@ -325,18 +398,10 @@ void GameMode::new_level() {
 		goal->transform->position = vec3(longest_end.x, longest_end.y, 0.5f);
 		goal->transform->scale = vec3(0.3f, 0.3f, 0.3f);
 
-		goal->programs[Scene::Object::ProgramTypeDefault] = texture_program_info;
-		goal->programs[Scene::Object::ProgramTypeDefault].textures[0] = *white_tex;
-		
-
-		goal->programs[Scene::Object::ProgramTypeShadow] = depth_program_info;
-
 		MeshBuffer::Mesh const &mesh = meshes->lookup("Cube");
-		goal->programs[Scene::Object::ProgramTypeDefault].start = mesh.start;
-		goal->programs[Scene::Object::ProgramTypeDefault].count = mesh.count;
+		set_mesh_programs(goal, mesh, *white_tex);
 
-		goal->programs[Scene::Object::ProgramTypeShadow].start = mesh.start;
-		goal->programs[Scene::Object::ProgramTypeShadow].count = mesh.count;
+		goal->set_bounds(mesh.min, mesh.max);
 	}
 	
 
@@ -350,18 +415,10 @@ void GameMode::new_level() {
 			Scene::Object *obj = scene.new_object(scene.new_transform());
 			obj->transform->scale = vec3(0.3f, 0.3f, 0.3f);
 
-			obj->programs[Scene::Object::ProgramTypeDefault] = texture_program_info;
-			obj->programs[Scene::Object::ProgramTypeDefault].textures[0] = *marble_tex;
-			
-
-			obj->programs[Scene::Object::ProgramTypeShadow] = depth_program_info;
-
 			MeshBuffer::Mesh const &mesh = meshes->lookup("Cube");
-			obj->programs[Scene::Object::ProgramTypeDefault].start = mesh.start;
-			obj->programs[Scene::Object::ProgramTypeDefault].count = mesh.count;
+			set_mesh_programs(obj, mesh, *marble_tex);
 
-			obj->programs[Scene::Object::ProgramTypeShadow].start = mesh.start;
-			obj->programs[Scene::Object::ProgramTypeShadow].count = mesh.count;
+			obj->set_bounds(mesh.min, mesh.max);
 
 			Guard *s = new Guard(&scene, obj);
 			size_t index = random_gen() % dead_ends.size();
@@ -377,18 +434,10 @@ void GameMode::new_level() {
 			Scene::Object *obj = scene.new_object(scene.new_transform());
 			obj->transform->scale = vec3(0.3f, 0.3f, 0.3f);
 
-			obj->programs[Scene::Object::ProgramTypeDefault] = texture_program_info;
-			obj->programs[Scene::Object::ProgramTypeDefault].textures[0] = *marble_tex;
-			
-
-			obj->programs[Scene::Object::ProgramTypeShadow] = depth_program_info;
-
 			MeshBuffer::Mesh const &mesh = meshes->lookup("Cube");
-			obj->programs[Scene::Object::ProgramTypeDefault].start = mesh.start;
-			obj->programs[Scene::Object::ProgramTypeDefault].count = mesh.count;
+			set_mesh_programs(obj, mesh, *marble_tex);
 
-			obj->programs[Scene::Object::ProgramTypeShadow].start = mesh.start;
-			obj->programs[Scene::Object::ProgramTypeShadow].count = mesh.count;
+			obj->set_bounds(mesh.min, mesh.max);
 
 			Scout *s = new Scout(&scene, obj);
 			obj->transform->position.y = 10.f;
@@ -399,11 +448,35 @@ void GameMode::new_level() {
 }
 
 GameMode::GameMode() {
+	//the maze is flat, so a grid (two cells per maze square) suits it:
+	scene.spatial_index.reset(new SpatialIndex(SpatialIndex::Grid, 2.0f));
+
+	post_chain.effects.emplace_back();
+	post_chain.effects.back().name = "blur";
+	post_chain.effects.back().program = *blur_program;
+	post_chain.effects.back().inputs.emplace_back("scene");
+	post_chain.effects.back().enabled = false; //(toggled with B)
 
 	new_level();
 }
 
 GameMode::~GameMode() {
+	if (wall_tex != 0) {
+		glDeleteTextures(1, &wall_tex);
+		wall_tex = 0;
+	}
+	if (wall_mask_buffer != 0) {
+		glDeleteBuffers(1, &wall_mask_buffer);
+		wall_mask_buffer = 0;
+	}
+	if (wall_mask_vao != 0) {
+		glDeleteVertexArrays(1, &wall_mask_vao);
+		wall_mask_vao = 0;
+	}
+	for (LightQuery &query : light_queries) {
+		glDeleteQueries(1, &query.query);
+	}
+	light_queries.clear();
 }
 
 static float mousex;
@@ -450,6 +523,35 @@ bool GameMode::handle_event(SDL_Event const &evt, glm::uvec2 const &window_size)
 		case SDL_SCANCODE_S:
 			controls.down = true;
 			break;
+		case SDL_SCANCODE_TAB:
+			deferred_lighting = !deferred_lighting;
+			std::cout << "Lighting: " << (deferred_lighting ? "deferred" : "forward") << std::endl;
+			break;
+		case SDL_SCANCODE_G:
+			wall_shadows = WallShadows((wall_shadows + 1) % 3);
+			//(cached shadow maps hold the old mode's static layer)
+			shadow_cache.clear();
+			shadow_atlas.clear();
+			std::cout << "Wall shadows: " << (
+				wall_shadows == WallShadowMaps ? "shadow maps" :
+				wall_shadows == WallShadowPolygons ? "visibility polygons in shadow maps" :
+				"grid ray-march") << std::endl;
+			break;
+		case SDL_SCANCODE_O:
+			occlusion_queries = !occlusion_queries;
+			//(cached shadow maps may have been drawn conditional on queries that won't be read now)
+			shadow_cache.clear();
+			shadow_atlas.clear();
+			std::cout << "Occlusion queries: " << (occlusion_queries ? "on" : "off") << std::endl;
+			break;
+		case SDL_SCANCODE_B:
+			post_chain.effects[0].enabled = !post_chain.effects[0].enabled;
+			std::cout << "Edge blur: " << (post_chain.effects[0].enabled ? "on" : "off") << std::endl;
+			break;
+		case SDL_SCANCODE_L:
+			layered_shadows = !layered_shadows;
+			std::cout << "Shadow maps: " << (layered_shadows ? "layered (one pass for all lights)" : "one pass per light") << std::endl;
+			break;
 		default:
 			return false;
 		}
@@ -478,6 +580,8 @@ bool GameMode::handle_event(SDL_Event const &evt, glm::uvec2 const &window_size)
 }
 
 void GameMode::update(float elapsed) {
+	frame_time = glm::mix(frame_time, elapsed, 0.1f); //(smoothed, for draw()'s shadow quality)
+
 	//camera_parent_transform->rotation = glm::angleAxis(camera_spin, glm::vec3(0.0f, 0.0f, 1.0f));
 	//spot_parent_transform->rotation = glm::angleAxis(spot_spin, glm::vec3(0.0f, 0.0f, 1.0f));
 	if(!dead) {
@@ -553,13 +657,24 @@ struct Framebuffers {
 	GLuint depth_rb = 0;
 	GLuint fb = 0;
 
-	//This framebuffer is used for shadow maps:
-	glm::uvec2 shadow_size = glm::uvec2(0,0);
-	GLuint shadow_color_tex = 0; //DEBUG
+	//This framebuffer holds surface attributes for deferred lighting (it shares depth_rb with the one above):
+	glm::uvec2 gbuffer_size = glm::uvec2(0,0);
+	GLuint albedo_tex = 0;
+	GLuint normal_tex = 0;
+	GLuint position_tex = 0;
+	GLuint gbuffer_fb = 0;
+
+	//This framebuffer is used for shadow maps, which are packed into an atlas (tiles are handed out by GameMode::shadow_atlas):
+	glm::uvec2 shadow_size = glm::uvec2(0,0); //size of the whole atlas
 	GLuint shadow_depth_tex = 0;
 	GLuint shadow_fb = 0;
+	//Static casters are drawn into a second atlas with the same layout, kept between frames (see GameMode::shadow_cache):
+	GLuint static_shadow_depth_tex = 0;
+	GLuint static_shadow_fb = 0;
+	uint32_t shadow_generation = 0; //incremented when the atlases are reallocated (which discards their contents)
 
-	void allocate(glm::uvec2 const &new_size, glm::uvec2 const &new_shadow_size) {
+	//(the G-buffer is only allocated once it is needed)
+	void allocate(glm::uvec2 const &new_size, glm::uvec2 const &new_shadow_size, bool need_gbuffer) {
 		//allocate full-screen framebuffer:
 		if (size != new_size) {
 			size = new_size;
@@ -575,13 +690,46 @@ struct Framebuffers {
 	
 			if (depth_rb == 0) glGenRenderbuffers(1, &depth_rb);
 			glBindRenderbuffer(GL_RENDERBUFFER, depth_rb);
-			glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, size.x, size.y);
+			glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH24_STENCIL8, size.x, size.y); //(stencil is used to mark light volumes)
 			glBindRenderbuffer(GL_RENDERBUFFER, 0);
 	
 			if (fb == 0) glGenFramebuffers(1, &fb);
 			glBindFramebuffer(GL_FRAMEBUFFER, fb);
 			glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, color_tex, 0);
-			glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, depth_rb);
+			glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_RENDERBUFFER, depth_rb);
+			check_fb();
+			glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+			GL_ERRORS();
+		}
+
+		//allocate G-buffer:
+		if (need_gbuffer && gbuffer_size != size) {
+			gbuffer_size = size;
+
+			auto alloc_tex = [this](GLuint *tex, GLint internal_format, GLenum format, GLenum type) {
+				if (*tex == 0) glGenTextures(1, tex);
+				glBindTexture(GL_TEXTURE_2D, *tex);
+				glTexImage2D(GL_TEXTURE_2D, 0, internal_format, gbuffer_size.x, gbuffer_size.y, 0, format, type, NULL);
+				glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+				glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+				glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+				glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+				glBindTexture(GL_TEXTURE_2D, 0);
+			};
+			//(float formats, so lighting from the G-buffer matches lighting done directly in texture_program)
+			alloc_tex(&albedo_tex, GL_RGBA16F, GL_RGBA, GL_FLOAT);
+			alloc_tex(&normal_tex, GL_RGB16F, GL_RGB, GL_FLOAT);
+			alloc_tex(&position_tex, GL_RGB32F, GL_RGB, GL_FLOAT);
+
+			if (gbuffer_fb == 0) glGenFramebuffers(1, &gbuffer_fb);
+			glBindFramebuffer(GL_FRAMEBUFFER, gbuffer_fb);
+			glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, albedo_tex, 0);
+			glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_TEXTURE_2D, normal_tex, 0);
+			glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT2, GL_TEXTURE_2D, position_tex, 0);
+			glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_RENDERBUFFER, depth_rb);
+			GLenum draw_buffers[3] = { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1, GL_COLOR_ATTACHMENT2 };
+			glDrawBuffers(3, draw_buffers);
 			check_fb();
 			glBindFramebuffer(GL_FRAMEBUFFER, 0);
 
@@ -592,31 +740,32 @@ struct Framebuffers {
 		if (shadow_size != new_shadow_size) {
 			shadow_size = new_shadow_size;
 
-			if (shadow_color_tex == 0) glGenTextures(1, &shadow_color_tex);
-			glBindTexture(GL_TEXTURE_2D, shadow_color_tex);
-			glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, shadow_size.x, shadow_size.y, 0, GL_RGB, GL_UNSIGNED_BYTE, NULL);
-			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-			glBindTexture(GL_TEXTURE_2D, 0);
-
-
-			if (shadow_depth_tex == 0) glGenTextures(1, &shadow_depth_tex);
-			glBindTexture(GL_TEXTURE_2D, shadow_depth_tex);
-			glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT24, shadow_size.x, shadow_size.y, 0, GL_DEPTH_COMPONENT, GL_UNSIGNED_BYTE, NULL);
-			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-			glBindTexture(GL_TEXTURE_2D, 0);
-	
-			if (shadow_fb == 0) glGenFramebuffers(1, &shadow_fb);
-			glBindFramebuffer(GL_FRAMEBUFFER, shadow_fb);
-			glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, shadow_color_tex, 0);
-			glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, shadow_depth_tex, 0);
-			check_fb();
-			glBindFramebuffer(GL_FRAMEBUFFER, 0);
+			++shadow_generation;
+
+			auto alloc_depth = [this](GLuint *tex, GLuint *fb) {
+				if (*tex == 0) glGenTextures(1, tex);
+				glBindTexture(GL_TEXTURE_2D, *tex);
+				glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT24, shadow_size.x, shadow_size.y, 0, GL_DEPTH_COMPONENT, GL_UNSIGNED_BYTE, NULL);
+				glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+				glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+				glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+				glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+				//The shadow_depth_tex must have these parameters set to be used as a sampler2DShadow in the shader:
+				glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_REF_TO_TEXTURE);
+				glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_COMPARE_FUNC, GL_LESS);
+				glBindTexture(GL_TEXTURE_2D, 0);
+
+				if (*fb == 0) glGenFramebuffers(1, fb);
+				glBindFramebuffer(GL_FRAMEBUFFER, *fb);
+				glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, *tex, 0);
+				//(depth only)
+				glDrawBuffer(GL_NONE);
+				glReadBuffer(GL_NONE);
+				check_fb();
+				glBindFramebuffer(GL_FRAMEBUFFER, 0);
+			};
+			alloc_depth(&shadow_depth_tex, &shadow_fb);
+			alloc_depth(&static_shadow_depth_tex, &static_shadow_fb);
 
 			GL_ERRORS();
 		}
@@ -624,7 +773,7 @@ struct Framebuffers {
 } fbs;
 
 void GameMode::draw(glm::uvec2 const &drawable_size) {
-	fbs.allocate(drawable_size, glm::uvec2(512, 512));
+	fbs.allocate(drawable_size, glm::uvec2(shadow_atlas.size), deferred_lighting);
 
 	glBindFramebuffer(GL_FRAMEBUFFER, fbs.fb);
 	glViewport(0,0,drawable_size.x, drawable_size.y);
@@ -636,36 +785,495 @@ void GameMode::draw(glm::uvec2 const &drawable_size) {
 	glClearColor(0.f, 0.0f, 0.0f, 0.0f);
 	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-	// Draw once for ambient light
-	glUseProgram(texture_program->program);
+	camera->aspect = drawable_size.x / float(drawable_size.y);
 
-	//don't use distant directional light at all (color == 0):
-	glUniform3fv(texture_program->sun_color_vec3, 1, glm::value_ptr(glm::vec3(0.0f, 0.0f, 0.0f)));
-	glUniform3fv(texture_program->sun_direction_vec3, 1, glm::value_ptr(glm::normalize(glm::vec3(0.0f, 0.0f,-1.0f))));
-	//little bit of ambient light:
-	glUniform3fv(texture_program->sky_color_vec3, 1, glm::value_ptr(dead ? glm::vec3(0.5f, 0.5f, 0.5f) : glm::vec3(0.0f, 0.0f, 0.0f)));
-	glUniform3fv(texture_program->sky_direction_vec3, 1, glm::value_ptr(glm::vec3(0.0f, 0.0f, 1.0f)));
-	
-	glUniform3fv(texture_program->spot_color_vec3, 1, glm::value_ptr(glm::vec3(0.0f, 0.0f, 0.0f)));
+	glm::mat4 world_to_clip = camera->make_projection() * camera->transform->make_world_to_local();
 
-	glActiveTexture(GL_TEXTURE1);
-	glBindTexture(GL_TEXTURE_2D, 0);
-	glActiveTexture(GL_TEXTURE0);
+	//camera and lighting constants used by every pass this frame:
+	uniform_ring.begin_frame();
+	{
+		FrameBlock frame;
+		frame.world_to_clip = world_to_clip;
+		frame.eye_position = glm::vec3(camera->transform->make_local_to_world()[3]);
+		//don't use distant directional light at all (color == 0):
+		frame.sun_color = glm::vec3(0.0f, 0.0f, 0.0f);
+		frame.sun_direction = glm::normalize(glm::vec3(0.0f, 0.0f,-1.0f));
+		//little bit of ambient light:
+		frame.sky_color = (dead ? glm::vec3(0.5f, 0.5f, 0.5f) : glm::vec3(0.0f, 0.0f, 0.0f));
+		frame.sky_direction = glm::vec3(0.0f, 0.0f, 1.0f);
+		if (wall_shadows == WallShadowGrid) {
+			frame.wall_grid = glm::vec4(MAP_WIDTH, MAP_HEIGHT, WallBottom, WallTop);
+		}
+		uniform_ring.push(FrameBinding, frame);
+	}
 
-	scene.draw(camera);
+	//lights near enough to the player to matter:
+	struct Light {
+		Scene::Lamp *lamp;
+		Scene::Object *body; //holds the lamp (left out of its shadow map)
+		float range; //distance the light reaches
+		glm::vec3 receivers_min, receivers_max; //bounds of the visible objects the light reaches
+		uint32_t stats; //index in light_stats
+		glm::mat4 world_to_clip; //view of the light's shadow map
+		uint32_t tile; //tile of the shadow atlas (and index in shadow_cache)
+		bool static_stale; //static layer of the shadow map is redrawn this frame
+		uint32_t static_pass; //index of the pass drawing static casters into it (-1U if not stale, or if wall_shadows doesn't draw the scene there)
+		uint32_t shadow_size; //width and height of the light's shadow map tile
+		float distance; //to the player or the camera, whichever is nearer
+		bool shadow_forced; //shadow map must be brought up to date this frame, budget or not
+		bool shadow_due; //shadow map may be brought up to date this frame (if within budget)
+		glm::vec2 screen_min, screen_max; //part of the screen (in pixels) the light reaches (empty if min > max)
+		bool wall_polygon; //static layer holds just the walls in the lamp's visibility polygon (WallShadowPolygons)
+		uint32_t query; //index in light_queries (-1U if the light isn't occlusion tested)
+		bool shadowed; //has a shadow map (otherwise it is lit without one)
+	};
+	std::vector< Light > lights;
 
-	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	//A spot reaches only as far as its frustum (which ends at clip_end) and its attenuation range
+	// (where attenuation drops below 1/256 -- solving 1 + 0.4 d + 0.8 d^2 = 256 for d, to match texture_lighting_glsl):
+	const float SpotRange = (-0.4f + std::sqrt(0.4f * 0.4f + 4.0f * 0.8f * 255.0f)) / (2.0f * 0.8f);
+	auto make_spot_world_to_clip = [](Scene::Lamp const *spot, float range) {
+		return glm::perspective(spot->fov, 1.0f, spot->clip_start, range) * spot->transform->make_world_to_local();
+	};
+	//...and the same pyramid as drawn by light_volume_program, from the camera:
+	auto make_volume_to_clip = [&world_to_clip](Scene::Lamp const *spot, float range) {
+		float half = range * std::tan(0.5f * spot->fov);
+		return world_to_clip * spot->transform->make_local_to_world()
+			* glm::mat4(
+				half, 0.0f, 0.0f, 0.0f,
+				0.0f, half, 0.0f, 0.0f,
+				0.0f, 0.0f, range, 0.0f,
+				0.0f, 0.0f, 0.0f, 1.0f
+			);
+	};
 
-	GL_ERRORS();
+	//Lights whose reach (a square pyramid) is entirely outside the camera's frustum are skipped:
+	Scene::Frustum camera_frustum(world_to_clip);
+	auto add_light = [&](Scene::Lamp *lamp, Scene::Object *body) {
+		float range = std::min(lamp->clip_end, SpotRange);
+		glm::mat4 const &spot_to_world = lamp->transform->make_local_to_world();
+		float half = range * std::tan(0.5f * lamp->fov);
+		glm::vec3 corners[5] = {
+			glm::vec3(spot_to_world * glm::vec4(0.0f, 0.0f, 0.0f, 1.0f)),
+			glm::vec3(spot_to_world * glm::vec4(-half,-half,-range, 1.0f)),
+			glm::vec3(spot_to_world * glm::vec4( half,-half,-range, 1.0f)),
+			glm::vec3(spot_to_world * glm::vec4( half, half,-range, 1.0f)),
+			glm::vec3(spot_to_world * glm::vec4(-half, half,-range, 1.0f)),
+		};
+		for (glm::vec4 const &plane : camera_frustum.planes) {
+			bool outside = true;
+			for (glm::vec3 const &corner : corners) {
+				if (glm::dot(glm::vec3(plane), corner) + plane.w >= 0.0f) {
+					outside = false;
+					break;
+				}
+			}
+			if (outside) return;
+		}
+		lights.push_back(Light{ lamp, body, range, glm::vec3(0.0f), glm::vec3(0.0f), 0 });
+	};
+	// Don't render player in light
+	//(the player's flashlight is culled like the rest, so 'lights' may not hold it -- or anything; it is found by body, not position)
+	add_light(player_lamp, player);
+	for (Enemy *enemy : enemies) {
+		add_light(enemy->light, enemy->object);
+	}
+	scene.update_spatial_index();
+
+	//nearest lights first (they are the ones kept if there are too many, and their shadows are updated first):
+	{
+		glm::vec3 player_at = glm::vec3(player->transform->make_local_to_world()[3]);
+		glm::vec3 eye_at = glm::vec3(camera->transform->make_local_to_world()[3]);
+		for (Light &light : lights) {
+			glm::vec3 at = glm::vec3(light.lamp->transform->make_local_to_world()[3]);
+			light.distance = std::min(glm::length(at - player_at), glm::length(at - eye_at));
+		}
+		//(the player's flashlight, if it is among them, goes first regardless)
+		std::stable_sort(lights.begin(), lights.end(), [this](Light const &a, Light const &b) {
+			if ((a.body == player) != (b.body == player)) return a.body == player;
+			return a.distance < b.distance;
+		});
+	}
 
-	auto render_from_spot = [&drawable_size, this](Scene::Lamp *spot) {
-		//printf("LAMP: %f %f %f\n", spot->transform->position.x, spot->transform->position.y, spot->transform->position.z);
-		//Draw scene to shadow map for spotlight:
-		glBindFramebuffer(GL_FRAMEBUFFER, fbs.shadow_fb);
-		glViewport(0,0,fbs.shadow_size.x, fbs.shadow_size.y);
+	//Only visible objects in a spot's reach receive its light, and it lights only the part of the screen where they overlap;
+	// a spot that covers too little of the screen (less than min_light_screen_fraction) is skipped, shadow map and all:
+	//Enemy lights whose last occlusion query (see LightQuery) saw nothing are left out, too, except to be tested again:
+	Scene::Object::ProgramType camera_program_type = (deferred_lighting ? Scene::Object::ProgramTypeGBuffer : Scene::Object::ProgramTypeDefault);
+	float min_light_screen_area = min_light_screen_fraction * float(drawable_size.x) * float(drawable_size.y);
+	light_stats.clear();
+	occluded_lights = 0;
+	std::vector< Light > hidden_lights;
+	std::vector< Light > decal_lights;
+	auto find_light_query = [this](Scene::Lamp const *lamp) {
+		uint32_t found = -1U;
+		for (uint32_t q = 0; q < light_queries.size(); ++q) {
+			if (light_queries[q].lamp == lamp) {
+				found = q;
+				break;
+			}
+			//(entries for lamps gone a while, with no query in flight, can be reused)
+			if (found == -1U && !light_queries[q].pending && light_queries[q].last_used + 2 < frame_number) found = q;
+		}
+		if (found == -1U) {
+			found = uint32_t(light_queries.size());
+			light_queries.emplace_back();
+			glGenQueries(1, &light_queries.back().query);
+		}
+		LightQuery &query = light_queries[found];
+		if (query.lamp != lamp || query.last_used + 1 < frame_number) {
+			//(a result from before the lamp was last a candidate says little about now)
+			query.lamp = lamp;
+			query.visible = true;
+		}
+		query.last_used = frame_number;
+
+		//read the result of the query in flight, if it has arrived:
+		GLuint available = 0;
+		if (query.pending) glGetQueryObjectuiv(query.query, GL_QUERY_RESULT_AVAILABLE, &available);
+		if (available) {
+			GLuint any_samples = 0;
+			glGetQueryObjectuiv(query.query, GL_QUERY_RESULT, &any_samples);
+			query.pending = false;
+			query.visible = (any_samples != 0);
+			if (!query.visible && query.conditional_shadow) {
+				//(so the GPU may have skipped the lamp's shadow map update; its cached map can't be trusted)
+				for (ShadowCacheEntry &entry : shadow_cache) {
+					if (entry.lamp != lamp) continue;
+					entry.static_version = -1U;
+					entry.dynamic_valid = false;
+				}
+			}
+			query.conditional_shadow = false;
+		}
+		return found;
+	};
+	glm::vec3 eye_at = glm::vec3(camera->transform->make_local_to_world()[3]);
+	{
+		uint32_t kept = 0;
+		for (Light &light : lights) {
+			light.stats = uint32_t(light_stats.size());
+			light_stats.emplace_back();
+			LightStats &stats = light_stats.back();
+			stats.lamp = light.lamp;
+
+			float inf = std::numeric_limits< float >::infinity();
+			light.receivers_min = glm::vec3(inf);
+			light.receivers_max = glm::vec3(-inf);
+			receivers.clear();
+			Scene::Frustum spot_frustum(make_spot_world_to_clip(light.lamp, light.range));
+			scene.spatial_index->query_frustum(spot_frustum, &receivers);
+			for (Scene::Object const *object : receivers) {
+				if (object->programs[camera_program_type].program == 0) continue;
+				glm::vec3 min, max;
+				if (object->make_world_bounds(&min, &max)) {
+					if (!camera_frustum.intersects_box(min, max)) continue;
+				} else {
+					min = glm::vec3(-inf);
+					max = glm::vec3(inf);
+				}
+				light.receivers_min = glm::min(light.receivers_min, min);
+				light.receivers_max = glm::max(light.receivers_max, max);
+				++stats.receivers_drawn;
+			}
+			if (stats.receivers_drawn == 0) continue;
 
-		glClearColor(1.0f, 0.0f, 1.0f, 0.0f);
-		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+			light.screen_min = glm::vec2(0.0f);
+			light.screen_max = glm::vec2(-1.0f);
+			if (spot_volume_in_box(light.lamp->transform->make_local_to_world(), light.lamp->fov, light.range, light.receivers_min, light.receivers_max, &spot_volume)) {
+				screen_bounds(world_to_clip, drawable_size, spot_volume, &light.screen_min, &light.screen_max);
+			}
+			glm::vec2 covered = glm::min(light.screen_max, glm::vec2(drawable_size)) - glm::max(light.screen_min, glm::vec2(0.0f));
+			if (covered.x <= 0.0f || covered.y <= 0.0f || covered.x * covered.y < min_light_screen_area) continue;
+
+			//Light level of detail: the player's flashlight always has a shadow map; other lights are lit without one when far or
+			// small on screen, and are only drawn as a decal on the floor when farther or smaller still -- or when pointing
+			// straight down, like the scouts' (whose light is meant to fall on the floor with nothing in between):
+			light.query = -1U;
+			light.shadowed = true;
+			if (light.body != player) {
+				float screen_fraction = covered.x * covered.y / (float(drawable_size.x) * float(drawable_size.y));
+				bool straight_down = (light.lamp->transform->make_local_to_world()[2].z > 0.99f); //(lamps look along -z)
+				if (straight_down || light.distance > decal_light_distance || screen_fraction < decal_light_screen_fraction) {
+					decal_lights.emplace_back(light);
+					continue;
+				}
+				light.shadowed = (light.distance <= unshadowed_light_distance && screen_fraction >= unshadowed_light_screen_fraction);
+			}
+
+			//(a query can't tell whether a light is hidden if the camera is in -- or about to be in -- its volume)
+			bool eye_outside = false;
+			for (glm::vec4 const &plane : spot_frustum.planes) {
+				if (glm::dot(glm::vec3(plane), eye_at) + plane.w < -0.1f * glm::length(glm::vec3(plane))) {
+					eye_outside = true;
+					break;
+				}
+			}
+			if (occlusion_queries && light.body != player && eye_outside) {
+				light.query = find_light_query(light.lamp);
+				if (!light_queries[light.query].visible) {
+					++occluded_lights;
+					hidden_lights.emplace_back(light);
+					continue;
+				}
+			}
+
+			if (kept < SpotsBlock::MaxSpots) {
+				lights[kept++] = light;
+			}
+		}
+		//(each light needs a slot in the Spots block)
+		lights.resize(kept);
+	}
+	//(lights with shadow maps first; they are the ones with shadow passes)
+	uint32_t shadowed_count = uint32_t(std::stable_partition(lights.begin(), lights.end(), [](Light const &light) {
+		return light.shadowed;
+	}) - lights.begin());
+	static_assert(uint32_t(SpotsBlock::MaxSpots) <= uint32_t(LightTiles::MaxLights), "Every spot fits in a tile mask.");
+
+	//Each light's shadow map gets a tile of the atlas sized to match how much of the screen the light covers
+	// (and reduced with distance beyond near_shadow_distance), within the atlas and within shadow_texel_budget.
+	//Frames slower than target_frame_time lower shadow_quality (which scales the budget); faster ones raise it again.
+	//Over budget, far lights lose resolution first:
+	if (frame_time > 1.1f * target_frame_time) { //(with some slack for timing jitter)
+		shadow_quality = std::max(0.25f, shadow_quality * 0.95f);
+	} else {
+		shadow_quality = std::min(1.0f, shadow_quality * 1.01f);
+	}
+	{
+		uint32_t max_tile = std::min(shadow_atlas.size / 2, max_shadow_tile);
+		uint64_t texels = 0;
+		for (uint32_t i = 0; i < shadowed_count; ++i) {
+			Light &light = lights[i];
+			glm::vec2 covered = glm::min(light.screen_max, glm::vec2(drawable_size)) - glm::max(light.screen_min, glm::vec2(0.0f));
+			float want = std::max(covered.x, covered.y) * shadow_texels_per_pixel;
+			if (light.distance > near_shadow_distance) want *= near_shadow_distance / light.distance;
+			light.shadow_size = shadow_atlas.min_tile;
+			while (light.shadow_size < want && light.shadow_size < max_tile) light.shadow_size *= 2;
+			texels += uint64_t(light.shadow_size) * uint64_t(light.shadow_size);
+		}
+		uint64_t atlas_texels = uint64_t(shadow_atlas.size) * uint64_t(shadow_atlas.size);
+		uint64_t budget = std::min(atlas_texels, uint64_t(double(shadow_quality) * double(shadow_texel_budget)));
+		for (uint32_t i = shadowed_count; i > 0 && texels > budget; --i) {
+			Light &light = lights[i - 1];
+			while (light.shadow_size > shadow_atlas.min_tile && texels > budget) {
+				texels -= 3 * (uint64_t(light.shadow_size) * uint64_t(light.shadow_size)) / 4;
+				light.shadow_size /= 2;
+			}
+		}
+	}
+
+	//Shadow maps are cached between frames, each in its own tile, in two layers:
+	// - static casters (the maze) are drawn into the static atlas only when the light moves or the maze changes
+	// - dynamic casters are drawn over a copy of that layer only when one of them (or the static layer) changes
+	//Out-of-date maps are redrawn nearest light first, at most shadow_update_budget per frame
+	// (the player's flashlight and lights without a map don't wait; distant lights only get a turn every distant_shadow_interval frames),
+	// and the others keep using their old map -- and the view it was drawn from -- until their turn comes:
+	++frame_number;
+	shadow_cache_stats = ShadowCacheStats();
+	uint32_t static_redraws = 0;
+	uint32_t static_passes = 0;
+	std::vector< Light > unshadowed_lights(lights.begin() + shadowed_count, lights.end());
+	uint32_t kept = 0;
+	for (uint32_t index = 0; index < shadowed_count; ++index) {
+		Light &light = lights[index];
+		//(casters beyond the light's reach can't shadow anything it lights, so the shadow frustum ends there too)
+		light.world_to_clip = make_spot_world_to_clip(light.lamp, light.range);
+
+		//find the lamp's cached shadow map, if any:
+		light.tile = -1U;
+		for (uint32_t t = 0; t < shadow_cache.size(); ++t) {
+			if (shadow_cache[t].lamp == light.lamp) {
+				light.tile = t;
+				break;
+			}
+		}
+		//(a map of the wrong size can't be reused)
+		if (light.tile != -1U && shadow_cache[light.tile].tile.size != 0 && shadow_cache[light.tile].tile.size != light.shadow_size) {
+			shadow_atlas.free(shadow_cache[light.tile].tile);
+			shadow_cache[light.tile] = ShadowCacheEntry();
+			shadow_cache[light.tile].lamp = light.lamp;
+		}
+		if (light.tile != -1U) shadow_cache[light.tile].last_used = frame_number; //(don't evict the lamp's own entry below)
+		if (light.tile == -1U || shadow_cache[light.tile].tile.size == 0) {
+			//...otherwise find room for one, evicting the maps of lamps that were used least recently (but not this frame):
+			ShadowAtlas::Tile tile;
+			uint32_t size = light.shadow_size;
+			while (!shadow_atlas.allocate(size, &tile)) {
+				uint32_t evict = -1U;
+				for (uint32_t t = 0; t < shadow_cache.size(); ++t) {
+					if (shadow_cache[t].tile.size == 0 || shadow_cache[t].last_used == frame_number) continue;
+					if (evict == -1U || shadow_cache[t].last_used < shadow_cache[evict].last_used) evict = t;
+				}
+				if (evict != -1U) {
+					shadow_atlas.free(shadow_cache[evict].tile);
+					shadow_cache[evict] = ShadowCacheEntry();
+				} else if (size > shadow_atlas.min_tile) {
+					size /= 2;
+				} else {
+					break;
+				}
+			}
+			if (tile.size == 0) {
+				//no room at all; light it without a shadow map:
+				if (light.tile != -1U) shadow_cache[light.tile] = ShadowCacheEntry();
+				light.shadowed = false;
+				unshadowed_lights.emplace_back(light);
+				continue;
+			}
+			if (light.tile == -1U) {
+				for (uint32_t t = 0; t < shadow_cache.size(); ++t) {
+					if (shadow_cache[t].lamp == nullptr) {
+						light.tile = t;
+						break;
+					}
+				}
+				if (light.tile == -1U) {
+					light.tile = uint32_t(shadow_cache.size());
+					shadow_cache.emplace_back();
+				}
+			}
+			shadow_cache[light.tile] = ShadowCacheEntry();
+			shadow_cache[light.tile].lamp = light.lamp;
+			shadow_cache[light.tile].tile = tile;
+			light.shadow_size = tile.size;
+		}
+		ShadowCacheEntry &entry = shadow_cache[light.tile];
+		entry.last_used = frame_number;
+
+		bool have_map = (entry.dynamic_valid && entry.shadow_generation == fbs.shadow_generation);
+		light.shadow_forced = (!have_map || light.body == player);
+		light.shadow_due = (light.shadow_forced
+			|| light.distance < near_shadow_distance
+			|| (frame_number + light.tile) % std::max(1U, distant_shadow_interval) == 0);
+
+		//(a visibility polygon stands in for the walls only if rays from the lamp can't pass over or under a wall and reach another)
+		float lamp_z = light.lamp->transform->make_local_to_world()[3].z;
+		light.wall_polygon = (wall_shadows == WallShadowPolygons && lamp_z >= WallBottom && lamp_z <= WallTop);
+
+		light.static_stale = false;
+		light.static_pass = -1U;
+		if (entry.static_version != scene.static_version
+		 || entry.shadow_generation != fbs.shadow_generation
+		 || entry.world_to_clip != light.world_to_clip) {
+			if (light.shadow_forced || (light.shadow_due && static_redraws < shadow_update_budget)) {
+				light.static_stale = true;
+				++static_redraws;
+				if (wall_shadows != WallShadowGrid && !light.wall_polygon) {
+					light.static_pass = static_passes; //(made into a pass index below, once the light count is known)
+					++static_passes;
+				}
+			} else {
+				light.shadow_due = false; //(the old map stays whole, as drawn from the old view)
+			}
+		}
+		lights[kept++] = lights[index];
+	}
+	lights.resize(kept);
+	shadowed_count = kept;
+	for (Light &light : lights) {
+		if (light.static_pass != -1U) light.static_pass += 1 + shadowed_count;
+	}
+	for (Light &light : unshadowed_lights) {
+		light.tile = -1U;
+		light.static_stale = false;
+		light.static_pass = -1U;
+		light.shadow_size = 0;
+		lights.emplace_back(light);
+	}
+	light_detail_stats.shadowed = shadowed_count;
+	light_detail_stats.unshadowed = uint32_t(lights.size()) - shadowed_count;
+	light_detail_stats.decals = uint32_t(decal_lights.size());
+
+	//prepare every view of the scene needed this frame (the camera, then the shadow map layers of each shadowed light) at once:
+	passes.resize(1 + shadowed_count + static_passes + (depth_prepass ? 1 : 0));
+	passes[0].world_to_clip = world_to_clip;
+	passes[0].program_type = camera_program_type;
+	passes[0].exclude = nullptr;
+	passes[0].filter = Scene::Pass::AllObjects;
+	for (uint32_t i = 0; i < shadowed_count; ++i) {
+		passes[1 + i].world_to_clip = lights[i].world_to_clip;
+		passes[1 + i].program_type = Scene::Object::ProgramTypeShadow;
+		passes[1 + i].exclude = lights[i].body;
+		passes[1 + i].filter = Scene::Pass::DynamicObjects;
+		if (lights[i].static_pass != -1U) {
+			Scene::Pass &pass = passes[lights[i].static_pass];
+			pass.world_to_clip = lights[i].world_to_clip;
+			pass.program_type = Scene::Object::ProgramTypeShadow;
+			pass.exclude = nullptr;
+			pass.filter = Scene::Pass::StaticObjects;
+		}
+	}
+	if (depth_prepass) {
+		//camera depth only, drawn with each object's depth_program (so every object the camera draws needs a ProgramTypeShadow program):
+		passes.back().world_to_clip = world_to_clip;
+		passes.back().program_type = Scene::Object::ProgramTypeShadow;
+		passes.back().exclude = nullptr;
+		passes.back().filter = Scene::Pass::AllObjects;
+	}
+	scene.prepare(&passes);
+	Scene::Pass const &camera_pass = passes[0];
+
+	for (LightStats &stats : light_stats) {
+		stats.receivers_culled = (camera_pass.objects_drawn > stats.receivers_drawn ? camera_pass.objects_drawn - stats.receivers_drawn : 0);
+		stats.casters_culled = scene.render_queue_drawable[Scene::Object::ProgramTypeShadow];
+	}
+	for (uint32_t i = 0; i < shadowed_count; ++i) {
+		//(static casters count as drawn only in frames that redraw the static layer)
+		LightStats &stats = light_stats[lights[i].stats];
+		stats.casters_drawn = passes[1 + i].objects_drawn;
+		if (lights[i].static_pass != -1U) stats.casters_drawn += passes[lights[i].static_pass].objects_drawn;
+		stats.casters_culled -= std::min(stats.casters_culled, stats.casters_drawn);
+	}
+
+	//With WallShadowPolygons, a lamp's static layer is just the wall faces its visibility polygon reaches, extruded to wall height:
+	auto draw_wall_mask = [this](Light const &light) {
+		glm::mat4 const &spot_to_world = light.lamp->transform->make_local_to_world();
+		glm::vec2 position = glm::vec2(spot_to_world[3]);
+		glm::vec3 direction = -glm::vec3(spot_to_world[2]);
+		//the polygon covers a cone around the lamp's direction holding its (square) frustum, or all the way around if the lamp tilts much:
+		glm::vec2 along = glm::vec2(direction);
+		float half_angle = 3.14159265f;
+		if (std::abs(direction.z) < 0.1f && along != glm::vec2(0.0f)) {
+			half_angle = std::atan(std::tan(0.5f * light.lamp->fov) * std::sqrt(2.0f)) + 0.1f;
+		}
+		visibility.compute(position, std::atan2(along.y, along.x), half_angle, light.range, &lamp_polygon);
+		wall_mask.clear();
+		lamp_polygon.extrude_walls(WallBottom, WallTop, &wall_mask);
+		if (wall_mask.empty()) return;
+
+		if (wall_mask_vao == 0) {
+			glGenBuffers(1, &wall_mask_buffer);
+			glGenVertexArrays(1, &wall_mask_vao);
+			glBindVertexArray(wall_mask_vao);
+			glBindBuffer(GL_ARRAY_BUFFER, wall_mask_buffer);
+			glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(glm::vec3), (GLbyte *)0);
+			glEnableVertexAttribArray(0);
+			glBindVertexArray(0);
+		}
+		glBindBuffer(GL_ARRAY_BUFFER, wall_mask_buffer);
+		glBufferData(GL_ARRAY_BUFFER, wall_mask.size() * sizeof(glm::vec3), wall_mask.data(), GL_STREAM_DRAW);
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+		//(these are the faces the light falls on, not the walls' back faces, so they are drawn both-sided and pushed back a little)
+		glDisable(GL_CULL_FACE);
+		glEnable(GL_POLYGON_OFFSET_FILL);
+		glPolygonOffset(2.0f, 4.0f);
+		glUseProgram(depth_program->program);
+		glUniformMatrix4fv(depth_program->object_to_clip_mat4, 1, GL_FALSE, glm::value_ptr(light.world_to_clip));
+		glBindVertexArray(wall_mask_vao);
+		glDrawArrays(GL_TRIANGLES, 0, GLsizei(wall_mask.size()));
+		glBindVertexArray(0);
+		glUseProgram(0);
+		glDisable(GL_POLYGON_OFFSET_FILL);
+		glEnable(GL_CULL_FACE);
+
+		GL_ERRORS();
+	};
+
+	//Bring every light's shadow map (in its own tile of the shadow atlas) up to date:
+	SpotsBlock spots;
+	spots.spot_count = int32_t(lights.size());
+	{
 		glEnable(GL_DEPTH_TEST);
 		glDisable(GL_BLEND);
 
@@ -673,115 +1281,455 @@ void GameMode::draw(glm::uvec2 const &drawable_size) {
 		glCullFace(GL_FRONT);
 		glEnable(GL_CULL_FACE);
 
-		scene.draw(spot, Scene::Object::ProgramTypeShadow);
+		//With layered_shadows, the layers to redraw are collected and drawn into each atlas with one submission
+		// (but lights with an occlusion query in flight are drawn on their own, since their updates are conditional on it):
+		layered_pass.layers.clear();
+		layer_tiles.clear();
+		auto draw_layer = [&](Light const &light, Scene::Pass const &pass, ShadowAtlas::Tile const &tile) {
+			if (layered_shadows && !(light.query != -1U && light_queries[light.query].pending)) {
+				layered_pass.layers.emplace_back(&pass);
+				layer_tiles.emplace_back(tile);
+			} else {
+				glViewport(tile.offset.x, tile.offset.y, tile.size, tile.size);
+				scene.submit(pass);
+			}
+		};
+		auto draw_layers = [&](GLuint fb) {
+			if (layered_pass.layers.empty()) return;
+			static_assert(uint32_t(SpotsBlock::MaxSpots) <= uint32_t(LayeredDepthProgram::MaxLayers), "Every shadowed light fits in one layered pass.");
+			assert(layered_pass.layers.size() <= LayeredDepthProgram::MaxLayers);
+			scene.prepare_layered(&layered_pass);
+
+			glm::mat4 layer_world_to_clip[LayeredDepthProgram::MaxLayers];
+			glm::vec4 layer_tile[LayeredDepthProgram::MaxLayers];
+			for (uint32_t l = 0; l < layered_pass.layers.size(); ++l) {
+				layer_world_to_clip[l] = layered_pass.layers[l]->world_to_clip;
+				glm::vec2 scale = glm::vec2(float(layer_tiles[l].size)) / glm::vec2(fbs.shadow_size);
+				glm::vec2 center = (glm::vec2(layer_tiles[l].offset) + 0.5f * float(layer_tiles[l].size)) / glm::vec2(fbs.shadow_size);
+				layer_tile[l] = glm::vec4(scale, 2.0f * center - 1.0f);
+			}
+			GLsizei count = GLsizei(layered_pass.layers.size());
 
-		glDisable(GL_CULL_FACE);
+			glBindFramebuffer(GL_FRAMEBUFFER, fb);
+			glViewport(0, 0, fbs.shadow_size.x, fbs.shadow_size.y);
+			glUseProgram(layered_depth_program->program);
+			glUniformMatrix4fv(layered_depth_program->layer_world_to_clip_mat4, count, GL_FALSE, glm::value_ptr(layer_world_to_clip[0]));
+			glUniform4fv(layered_depth_program->layer_tile_vec4, count, glm::value_ptr(layer_tile[0]));
+			for (uint32_t c = 0; c < 4; ++c) glEnable(GL_CLIP_DISTANCE0 + c);
+			scene.submit_layered(layered_pass, layered_depth_program->object_to_world_mat4x3, layered_depth_program->layer_mask_uint);
+			for (uint32_t c = 0; c < 4; ++c) glDisable(GL_CLIP_DISTANCE0 + c);
+			glUseProgram(0);
+
+			layered_pass.layers.clear();
+			layer_tiles.clear();
+			GL_ERRORS();
+		};
+		//(with an occlusion query in flight, the GPU skips a light's updates if the query -- when it has the result -- found the light hidden)
+		auto begin_conditional = [&](Light const &light) -> LightQuery * {
+			if (light.query == -1U || !light_queries[light.query].pending) return nullptr;
+			LightQuery *query = &light_queries[light.query];
+			glBeginConditionalRender(query->query, GL_QUERY_NO_WAIT);
+			return query;
+		};
 
-		glBindFramebuffer(GL_FRAMEBUFFER, fbs.fb);
-		glViewport(0,0,drawable_size.x, drawable_size.y);
+		//first, the static layers:
+		for (uint32_t i = 0; i < lights.size(); ++i) {
+			Scene::Lamp const *spot = lights[i].lamp;
+			SpotsBlock::Spot &info = spots.spots[i];
+			glm::mat4 spot_to_world = spot->transform->make_local_to_world();
+			info.position = glm::vec3(spot_to_world[3]);
+			info.direction = -glm::vec3(spot_to_world[2]);
+			info.color = glm::vec3(1.f, 1.f, 1.f);
+			info.outer_inner = glm::vec2(std::cos(0.5f * spot->fov), std::cos(0.85f * 0.5f * spot->fov));
+			info.shadowed = (i < shadowed_count ? 1.0f : 0.0f);
+			if (i >= shadowed_count) continue;
+
+			ShadowCacheEntry &entry = shadow_cache[lights[i].tile];
+			glm::uvec2 tile_min = entry.tile.offset;
+			glm::uvec2 tile_size = glm::uvec2(entry.tile.size);
+
+			if (lights[i].static_stale) {
+				LightQuery *query = begin_conditional(lights[i]);
+
+				//(with WallShadowGrid, the static layer is left empty -- walls shadow in the shader instead)
+				if (lights[i].static_pass != -1U || lights[i].wall_polygon) {
+					glBindFramebuffer(GL_FRAMEBUFFER, fbs.static_shadow_fb);
+					glViewport(tile_min.x, tile_min.y, tile_size.x, tile_size.y);
+					glScissor(tile_min.x, tile_min.y, tile_size.x, tile_size.y);
+					glEnable(GL_SCISSOR_TEST);
+					glClear(GL_DEPTH_BUFFER_BIT);
+					glDisable(GL_SCISSOR_TEST);
+
+					if (lights[i].static_pass != -1U) {
+						draw_layer(lights[i], passes[lights[i].static_pass], entry.tile);
+					} else {
+						draw_wall_mask(lights[i]);
+					}
+					++shadow_cache_stats.static_renders;
+				}
 
-		GL_ERRORS();
+				entry.world_to_clip = lights[i].world_to_clip;
+				entry.static_version = scene.static_version;
+				entry.shadow_generation = fbs.shadow_generation;
+				entry.dynamic_valid = false;
 
+				if (query) {
+					glEndConditionalRender();
+					query->conditional_shadow = true;
+				}
+			}
 
+			glm::vec2 scale = glm::vec2(tile_size) / glm::vec2(fbs.shadow_size);
+			glm::vec2 center = (glm::vec2(tile_min) + 0.5f * glm::vec2(tile_size)) / glm::vec2(fbs.shadow_size);
+			info.light_to_spot =
+				//This matrix converts from the spotlight's clip space ([-1,1]^3) into this light's tile of the atlas ([0,1]^2 overall) and depth map Z values ([0,1]):
+				glm::mat4(
+					0.5f * scale.x, 0.0f, 0.0f, 0.0f,
+					0.0f, 0.5f * scale.y, 0.0f, 0.0f,
+					0.0f, 0.0f, 0.5f, 0.0f,
+					center.x, center.y, 0.5f+0.00001f /* <-- bias */, 1.0f
+				)
+				//this is the world-to-clip matrix used when rendering the shadow map:
+				* entry.world_to_clip;
+		}
+		draw_layers(fbs.static_shadow_fb);
+
+		//then the full maps, dynamic casters over a copy of the static layer:
+		for (uint32_t i = 0; i < shadowed_count; ++i) {
+			ShadowCacheEntry &entry = shadow_cache[lights[i].tile];
+			glm::uvec2 tile_min = entry.tile.offset;
+			glm::uvec2 tile_size = glm::uvec2(entry.tile.size);
+
+			//the dynamic layer can be reused if the same dynamic casters are in the same places:
+			dynamic_casters.clear();
+			for (Scene::DrawItem const &item : passes[1 + i].items) {
+				if (!item.visible || item.object->programs[Scene::Object::ProgramTypeShadow].program == 0) continue;
+				dynamic_casters.emplace_back(item.object, item.object->transform->make_local_to_world());
+			}
+			if (entry.dynamic_valid && entry.dynamic_casters == dynamic_casters) {
+				++shadow_cache_stats.hits;
+			} else if (!lights[i].static_stale && !lights[i].shadow_forced
+				&& (!lights[i].shadow_due || shadow_cache_stats.dynamic_renders >= shadow_update_budget)) {
+				++shadow_cache_stats.postponed;
+			} else {
+				LightQuery *query = begin_conditional(lights[i]);
+
+				//start from the static layer...
+				if (wall_shadows == WallShadowGrid) {
+					glBindFramebuffer(GL_FRAMEBUFFER, fbs.shadow_fb);
+					glScissor(tile_min.x, tile_min.y, tile_size.x, tile_size.y);
+					glEnable(GL_SCISSOR_TEST);
+					glClear(GL_DEPTH_BUFFER_BIT);
+					glDisable(GL_SCISSOR_TEST);
+				} else {
+					glBindFramebuffer(GL_READ_FRAMEBUFFER, fbs.static_shadow_fb);
+					glBindFramebuffer(GL_DRAW_FRAMEBUFFER, fbs.shadow_fb);
+					glBlitFramebuffer(
+						tile_min.x, tile_min.y, tile_min.x + tile_size.x, tile_min.y + tile_size.y,
+						tile_min.x, tile_min.y, tile_min.x + tile_size.x, tile_min.y + tile_size.y,
+						GL_DEPTH_BUFFER_BIT, GL_NEAREST
+					);
+				}
 
-		//Draw scene to off-screen framebuffer:
-		glBindFramebuffer(GL_FRAMEBUFFER, fbs.fb);
+				//...and draw the dynamic casters over it:
+				glBindFramebuffer(GL_FRAMEBUFFER, fbs.shadow_fb);
+				draw_layer(lights[i], passes[1 + i], entry.tile);
 
-		camera->aspect = drawable_size.x / float(drawable_size.y);
+				entry.dynamic_casters.swap(dynamic_casters);
+				entry.dynamic_valid = true;
+				++shadow_cache_stats.dynamic_renders;
 
+				if (query) {
+					glEndConditionalRender();
+					query->conditional_shadow = true;
+				}
+			}
+		}
+		draw_layers(fbs.shadow_fb);
 
-		//set up basic OpenGL state:
-		glEnable(GL_DEPTH_TEST);
+		glDisable(GL_CULL_FACE);
 		glEnable(GL_BLEND);
-		glBlendEquation(GL_FUNC_ADD);
-		glBlendFunc (GL_SRC_ALPHA, GL_DST_ALPHA);
-		glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
-		glDepthFunc(GL_LEQUAL);
-		//glClear(GL_DEPTH_BUFFER_BIT);
 
-		//set up light positions:
-		glUseProgram(texture_program->program);
+		glBindFramebuffer(GL_FRAMEBUFFER, fbs.fb);
+		glViewport(0,0,drawable_size.x, drawable_size.y);
 
-		//don't use distant directional light at all (color == 0):
-		glUniform3fv(texture_program->sun_color_vec3, 1, glm::value_ptr(glm::vec3(0.0f, 0.0f, 0.0f)));
-		glUniform3fv(texture_program->sun_direction_vec3, 1, glm::value_ptr(glm::normalize(glm::vec3(0.0f, 0.0f,-1.0f))));
-		//no ambient light:
-		glUniform3fv(texture_program->sky_color_vec3, 1, glm::value_ptr(glm::vec3(0.0f, 0.0f, 0.0f)));
-		glUniform3fv(texture_program->sky_direction_vec3, 1, glm::value_ptr(glm::vec3(0.0f, 0.0f, 1.0f)));
-
-		glm::mat4 world_to_spot =
-			//This matrix converts from the spotlight's clip space ([-1,1]^3) into depth map texture coordinates ([0,1]^2) and depth map Z values ([0,1]):
-			glm::mat4(
-				0.5f, 0.0f, 0.0f, 0.0f,
-				0.0f, 0.5f, 0.0f, 0.0f,
-				0.0f, 0.0f, 0.5f, 0.0f,
-				0.5f, 0.5f, 0.5f+0.00001f /* <-- bias */, 1.0f
-			)
-			//this is the world-to-clip matrix used when rendering the shadow map:
-			* spot->make_projection() * spot->transform->make_world_to_local();
-
-		glUniformMatrix4fv(texture_program->light_to_spot_mat4, 1, GL_FALSE, glm::value_ptr(world_to_spot));
-
-		glm::mat4 spot_to_world = spot->transform->make_local_to_world();
-		glUniform3fv(texture_program->spot_position_vec3, 1, glm::value_ptr(glm::vec3(spot_to_world[3])));
-		glUniform3fv(texture_program->spot_direction_vec3, 1, glm::value_ptr(-glm::vec3(spot_to_world[2])));
-		glUniform3fv(texture_program->spot_color_vec3, 1, glm::value_ptr(glm::vec3(1.f, 1.f, 1.f)));
-
-		glm::vec2 spot_outer_inner = glm::vec2(std::cos(0.5f * spot->fov), std::cos(0.85f * 0.5f * spot->fov));
-		glUniform2fv(texture_program->spot_outer_inner_vec2, 1, glm::value_ptr(spot_outer_inner));
-
-		//This code binds texture index 1 to the shadow map:
-		// (note that this is a bit brittle -- it depends on none of the objects in the scene having a texture of index 1 set in their material data; otherwise scene::draw would unbind this texture):
+		GL_ERRORS();
+	}
+
+	//With depth_prepass, the camera's depth is laid down before the color-writing pass,
+	// which then tests GL_EQUAL without writing depth, so it shades each pixel once no matter the overdraw:
+	// (vertex shaders declare gl_Position invariant so both passes compute the same depths)
+	auto begin_depth_prepass = [this]() {
+		if (!depth_prepass) return;
+		glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+		scene.submit(passes.back());
+		glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+		glDepthMask(GL_FALSE);
+		glDepthFunc(GL_EQUAL);
+	};
+	auto end_depth_prepass = [this]() {
+		if (!depth_prepass) return;
+		glDepthFunc(GL_LESS);
+		glDepthMask(GL_TRUE);
+	};
+
+	//This code binds texture index 1 to the shadow atlas:
+	// (note that this is a bit brittle -- Scene::submit unbinds units 0-3 when it returns, so this must be redone after every submit
+	//  that comes before a draw reading the atlas; and during a submit, an object with a texture of index 1 in its material data would replace it):
+	//...and texture index 4 to the walls (used by WallShadowGrid; past the units Scene::submit binds and unbinds):
+	auto bind_shadow_atlas = [this](){
 		glActiveTexture(GL_TEXTURE1);
 		glBindTexture(GL_TEXTURE_2D, fbs.shadow_depth_tex);
-		//The shadow_depth_tex must have these parameters set to be used as a sampler2DShadow in the shader:
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_REF_TO_TEXTURE);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_COMPARE_FUNC, GL_LESS);
-		//NOTE: however, these are parameters of the texture object, not the binding point, so there is no need to set them *each frame*. I'm doing it here so that you are likely to see that they are being set.
+		glActiveTexture(GL_TEXTURE4);
+		glBindTexture(GL_TEXTURE_2D, wall_tex);
 		glActiveTexture(GL_TEXTURE0);
+	};
 
-		scene.draw(camera);
+	//Test the volume of each occlusion-tested light (hidden or not) against the camera's depth, once that is complete:
+	// (lights whose query is still in flight aren't tested again until its result is read)
+	auto issue_light_queries = [&]() {
+		if (!occlusion_queries) return;
+		glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+		glDepthMask(GL_FALSE);
+		glEnable(GL_CULL_FACE); //(front faces only: the camera is outside every tested volume)
+		glCullFace(GL_BACK);
+		glUseProgram(light_volume_program->program);
+		glBindVertexArray(*empty_vao);
+		auto issue = [&](Light const &light) {
+			if (light.query == -1U) return;
+			LightQuery &query = light_queries[light.query];
+			if (query.pending) return;
+			glm::mat4 volume_to_clip = make_volume_to_clip(light.lamp, light.range);
+			glUniformMatrix4fv(light_volume_program->volume_to_clip_mat4, 1, GL_FALSE, glm::value_ptr(volume_to_clip));
+			glBeginQuery(GL_ANY_SAMPLES_PASSED, query.query);
+			glDrawArrays(GL_TRIANGLES, 0, 18);
+			glEndQuery(GL_ANY_SAMPLES_PASSED);
+			query.pending = true;
+		};
+		for (Light const &light : lights) {
+			issue(light);
+		}
+		for (Light const &light : hidden_lights) {
+			issue(light);
+		}
+		glBindVertexArray(0);
+		glUseProgram(0);
+		glDisable(GL_CULL_FACE);
+		glDepthMask(GL_TRUE);
+		glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
 
-		glActiveTexture(GL_TEXTURE1);
-		glBindTexture(GL_TEXTURE_2D, 0);
-		glActiveTexture(GL_TEXTURE0);
+		GL_ERRORS();
+	};
 
-		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	//Decal lights each add their (unshadowed) light to the floor where their frustum meets it, as one rectangle drawn over the lit scene:
+	auto draw_light_decals = [&]() {
+		if (decal_lights.empty()) return;
+		glUseProgram(spot_decal_program->program);
+		glUniform3fv(spot_decal_program->albedo_vec3, 1, glm::value_ptr(decal_albedo));
+		glUniform1f(spot_decal_program->height_float, floor_height);
+		glBindVertexArray(*empty_vao);
+		glDepthMask(GL_FALSE);
+		glDepthFunc(GL_LEQUAL);
+		glEnable(GL_POLYGON_OFFSET_FILL);
+		glPolygonOffset(-1.0f, -1.0f); //(so that it lands on the floor's own depth)
+		glBlendFunc(GL_ONE, GL_ONE);
+		for (Light const &light : decal_lights) {
+			glm::mat4 const &spot_to_world = light.lamp->transform->make_local_to_world();
+			float half = light.range * std::tan(0.5f * light.lamp->fov);
+			glm::vec3 apex = glm::vec3(spot_to_world[3]);
+			glm::vec3 base[4] = {
+				glm::vec3(spot_to_world * glm::vec4(-half,-half,-light.range, 1.0f)),
+				glm::vec3(spot_to_world * glm::vec4( half,-half,-light.range, 1.0f)),
+				glm::vec3(spot_to_world * glm::vec4( half, half,-light.range, 1.0f)),
+				glm::vec3(spot_to_world * glm::vec4(-half, half,-light.range, 1.0f)),
+			};
+			//bound where the frustum's edges cross the floor:
+			float inf = std::numeric_limits< float >::infinity();
+			glm::vec2 min = glm::vec2(inf);
+			glm::vec2 max = glm::vec2(-inf);
+			auto cross_floor = [&](glm::vec3 const &a, glm::vec3 const &b) {
+				if (a.z == b.z || (a.z - floor_height) * (b.z - floor_height) > 0.0f) return;
+				glm::vec2 at = glm::vec2(glm::mix(a, b, (floor_height - a.z) / (b.z - a.z)));
+				min = glm::min(min, at);
+				max = glm::max(max, at);
+			};
+			for (uint32_t c = 0; c < 4; ++c) {
+				cross_floor(apex, base[c]);
+				cross_floor(base[c], base[(c + 1) % 4]);
+			}
+			if (min.x > max.x) continue; //(doesn't reach the floor)
+
+			LightBlock block;
+			block.ambient = 0.0f;
+			block.spot_position = apex;
+			block.spot_shadowed = 0.0f;
+			block.spot_direction = -glm::vec3(spot_to_world[2]);
+			block.spot_color = glm::vec3(1.f, 1.f, 1.f);
+			block.spot_outer_inner = glm::vec2(std::cos(0.5f * light.lamp->fov), std::cos(0.85f * 0.5f * light.lamp->fov));
+			uniform_ring.push(LightBinding, block);
+
+			glUniform4f(spot_decal_program->rect_vec4, min.x, min.y, max.x, max.y);
+			glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+		}
+		glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+		glDisable(GL_POLYGON_OFFSET_FILL);
+		glDepthFunc(GL_LESS);
+		glDepthMask(GL_TRUE);
+		glBindVertexArray(0);
+		glUseProgram(0);
 
 		GL_ERRORS();
 	};
 
-	for(Enemy *enemy : enemies) {
-		vec3 dif_vec = enemy->object->transform->position - player->transform->position;
-		// Don't render lights outside of viewport
-		if(abs(dif_vec.x) > 7.f || abs(dif_vec.y) > 6.f) {
-			continue;
+	if (!deferred_lighting) {
+		//Forward lighting: draw the scene once, with each pixel lit by the spots listed for its screen tile.
+
+		light_tiles.clear(drawable_size);
+		for (uint32_t i = 0; i < lights.size(); ++i) {
+			light_tiles.add(i, lights[i].screen_min, lights[i].screen_max);
 		}
+		light_tiles.upload();
 
-		//printf("ENEMY %p\n", enemy);
-		GLuint old_count = enemy->object->programs[Scene::Object::ProgramTypeShadow].count;
-		enemy->object->programs[Scene::Object::ProgramTypeShadow].count = 0;
-		render_from_spot(enemy->light);
-		enemy->object->programs[Scene::Object::ProgramTypeShadow].count = old_count;
-	}
+		uniform_ring.push(SpotsBinding, spots);
 
-	// Don't render player in light
-	GLuint old_count = player->programs[Scene::Object::ProgramTypeShadow].count;
-	player->programs[Scene::Object::ProgramTypeShadow].count = 0;
-	render_from_spot(player_lamp);
-	player->programs[Scene::Object::ProgramTypeShadow].count = old_count;
-	
-	//Copy scene from color buffer to screen, performing post-processing effects:
-	glActiveTexture(GL_TEXTURE0);
-	glBindTexture(GL_TEXTURE_2D, fbs.color_tex);
-	glUseProgram(*blur_program);
-	glBindVertexArray(*empty_vao);
+		//(before binding the atlas and tiles, since the pre-pass's submit unbinds them)
+		begin_depth_prepass();
 
-	glDrawArrays(GL_TRIANGLES, 0, 3);
+		bind_shadow_atlas();
+		glActiveTexture(GL_TEXTURE2);
+		glBindTexture(GL_TEXTURE_2D, light_tiles.tex);
+		glActiveTexture(GL_TEXTURE0);
 
-	glUseProgram(0);
-	glActiveTexture(GL_TEXTURE0);
+		scene.submit(camera_pass); //(unbinds textures when done)
+		end_depth_prepass();
+
+		issue_light_queries();
+		draw_light_decals();
+	} else {
+		//Deferred lighting: draw the scene once into the G-buffer, then light the stored surfaces with a fullscreen pass per light.
+		glBindFramebuffer(GL_FRAMEBUFFER, fbs.gbuffer_fb);
+		glClearColor(0.0f, 0.0f, 0.0f, 0.0f); //(zero alpha marks pixels with no surface)
+		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+		glDisable(GL_BLEND);
+
+		begin_depth_prepass();
+		scene.submit(camera_pass);
+		end_depth_prepass();
+
+		glEnable(GL_BLEND);
+		glBindFramebuffer(GL_FRAMEBUFFER, fbs.fb);
+		GL_ERRORS();
+
+		auto light_surfaces = [](){
+			glDisable(GL_DEPTH_TEST);
+			glActiveTexture(GL_TEXTURE0);
+			glBindTexture(GL_TEXTURE_2D, fbs.albedo_tex);
+			glActiveTexture(GL_TEXTURE2);
+			glBindTexture(GL_TEXTURE_2D, fbs.normal_tex);
+			glActiveTexture(GL_TEXTURE3);
+			glBindTexture(GL_TEXTURE_2D, fbs.position_tex);
+			glUseProgram(deferred_light_program->program);
+			glBindVertexArray(*empty_vao);
+
+			glDrawArrays(GL_TRIANGLES, 0, 3);
+
+			glBindVertexArray(0);
+			glUseProgram(0);
+			glBindTexture(GL_TEXTURE_2D, 0);
+			glActiveTexture(GL_TEXTURE2);
+			glBindTexture(GL_TEXTURE_2D, 0);
+			glActiveTexture(GL_TEXTURE0);
+			glBindTexture(GL_TEXTURE_2D, 0);
+			glEnable(GL_DEPTH_TEST);
+		};
+
+		// Draw once for ambient light
+		{
+			LightBlock light;
+			light.ambient = 1.0f; //(sun and sky light are only added in this pass)
+			light.spot_color = glm::vec3(0.0f, 0.0f, 0.0f);
+			uniform_ring.push(LightBinding, light);
+		}
+		light_surfaces();
+
+		issue_light_queries();
+
+		//...then add each spot, shading only pixels it can reach:
+		// - the scissor rectangle limits the pass to the light's part of the screen
+		// - (if stencil_light_volumes) the stencil buffer further limits it to pixels whose surfaces are inside the light's volume
+		glBlendFunc (GL_SRC_ALPHA, GL_DST_ALPHA);
+		bind_shadow_atlas();
+		glEnable(GL_SCISSOR_TEST);
+		for (uint32_t i = 0; i < lights.size(); ++i) {
+			glm::ivec2 scissor_min = glm::max(glm::ivec2(glm::floor(lights[i].screen_min)), glm::ivec2(0));
+			glm::ivec2 scissor_max = glm::min(glm::ivec2(glm::ceil(lights[i].screen_max)), glm::ivec2(drawable_size));
+			if (scissor_min.x >= scissor_max.x || scissor_min.y >= scissor_max.y) continue; //(reaches nothing on screen)
+			glScissor(scissor_min.x, scissor_min.y, scissor_max.x - scissor_min.x, scissor_max.y - scissor_min.y);
+
+			//(the light's query was most likely issued just above, so waiting for it only waits on the GPU)
+			bool conditional = (lights[i].query != -1U && light_queries[lights[i].query].pending);
+			if (conditional) glBeginConditionalRender(light_queries[lights[i].query].query, GL_QUERY_WAIT);
+
+			if (stencil_light_volumes) {
+				//count (with depth-fail, so this works with the camera inside the volume) the volume's faces behind each surface:
+				// back faces add one and front faces subtract one, leaving non-zero stencil where the surface is inside.
+				glClear(GL_STENCIL_BUFFER_BIT); //(only inside the scissor rectangle)
+				glEnable(GL_STENCIL_TEST);
+				glStencilFunc(GL_ALWAYS, 0, 0xff);
+				glStencilOpSeparate(GL_BACK, GL_KEEP, GL_INCR_WRAP, GL_KEEP);
+				glStencilOpSeparate(GL_FRONT, GL_KEEP, GL_DECR_WRAP, GL_KEEP);
+				glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+				glDepthMask(GL_FALSE);
+
+				glm::mat4 volume_to_clip = make_volume_to_clip(lights[i].lamp, lights[i].range);
+				glUseProgram(light_volume_program->program);
+				glUniformMatrix4fv(light_volume_program->volume_to_clip_mat4, 1, GL_FALSE, glm::value_ptr(volume_to_clip));
+				glBindVertexArray(*empty_vao);
+				glDrawArrays(GL_TRIANGLES, 0, 18);
+				glBindVertexArray(0);
+				glUseProgram(0);
+
+				glDepthMask(GL_TRUE);
+				glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+				glStencilFunc(GL_NOTEQUAL, 0, 0xff);
+				glStencilOp(GL_KEEP, GL_KEEP, GL_KEEP);
+			}
+
+			SpotsBlock::Spot const &info = spots.spots[i];
+			LightBlock light;
+			light.ambient = 0.0f; //(no sun or sky light)
+			light.light_to_spot = info.light_to_spot;
+			light.spot_position = info.position;
+			light.spot_shadowed = info.shadowed;
+			light.spot_direction = info.direction;
+			light.spot_color = info.color;
+			light.spot_outer_inner = info.outer_inner;
+			uniform_ring.push(LightBinding, light);
+
+			light_surfaces();
+
+			glDisable(GL_STENCIL_TEST);
+			if (conditional) glEndConditionalRender();
+		}
+		glDisable(GL_SCISSOR_TEST);
+		glBlendFunc (GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+
+		draw_light_decals();
+
+		glActiveTexture(GL_TEXTURE1);
+		glBindTexture(GL_TEXTURE_2D, 0);
+		glActiveTexture(GL_TEXTURE0);
+	}
+	glActiveTexture(GL_TEXTURE4);
 	glBindTexture(GL_TEXTURE_2D, 0);
+	glActiveTexture(GL_TEXTURE0);
+
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+	GL_ERRORS();
+	
+	//Copy scene from color buffer to screen, performing post-processing effects:
+	post_chain.run(fbs.fb, fbs.color_tex, drawable_size);
 }
 
 
@@ -5,6 +5,10 @@
 #include "MeshBuffer.hpp"
 #include "GL.hpp"
 #include "Scene.hpp"
+#include "light_tiles.hpp"
+#include "shadow_atlas.hpp"
+#include "visibility.hpp"
+#include "post_chain.hpp"
 
 #include <SDL.h>
 #include <glm/glm.hpp>
@@ -46,6 +50,115 @@ struct GameMode : public Mode {
 	} controls;
 
 	Scene scene;
+	std::vector< Scene::Pass > passes; //views of the scene drawn each frame (kept to reuse their memory)
+	PostChain post_chain; //effects applied on the way to the screen (with none enabled, the scene is just copied there)
+	LightTiles light_tiles; //which spot lights reach each part of the screen (forward lighting)
+	std::vector< glm::vec3 > spot_volume; //(scratch space for finding light_tiles)
+	std::vector< Scene::Object const * > receivers; //(scratch space for culling lights)
+
+	//per-light culling counts for the last frame drawn (lights whose reach meets the camera frustum; ones then found to reach no visible object, or too little of the screen, are skipped):
+	struct LightStats {
+		Scene::Lamp const *lamp = nullptr;
+		uint32_t casters_drawn = 0; //objects drawn into the light's shadow map
+		uint32_t casters_culled = 0; //...and left out of it
+		uint32_t receivers_drawn = 0; //visible objects the light reaches
+		uint32_t receivers_culled = 0; //...and visible objects it doesn't
+	};
+	std::vector< LightStats > light_stats;
+	float min_light_screen_fraction = 0.001f; //lights covering less of the screen than this are skipped
+
+	//shadow map resolution (see draw()):
+	ShadowAtlas shadow_atlas = ShadowAtlas(2048, 64); //tiles for every light's shadow map
+	float shadow_texels_per_pixel = 1.0f; //shadow map size, relative to the light's extent on screen
+	uint32_t max_shadow_tile = 1024; //largest shadow map
+	uint64_t shadow_texel_budget = 1536 * 1536; //total shadow map area, at full quality
+	float shadow_quality = 1.0f; //scales shadow_texel_budget; lowered while frames take longer than target_frame_time
+	float target_frame_time = 1.0f / 60.0f;
+	float frame_time = 1.0f / 60.0f; //(smoothed)
+
+	//shadow maps kept between frames, each in a tile of the shadow atlas:
+	// (the static layer -- maze walls and floor -- is redrawn when the lamp moves or the maze changes;
+	//  the full map is redrawn over a copy of it when any dynamic caster in the light's frustum moves)
+	struct ShadowCacheEntry {
+		Scene::Lamp const *lamp = nullptr; //lamp whose shadow map this is (nullptr for unused entries)
+		ShadowAtlas::Tile tile; //where the map is (tile.size is 0 if none)
+		glm::mat4 world_to_clip = glm::mat4(1.0f); //lamp's view when the static layer was drawn
+		uint32_t static_version = -1U; //Scene::static_version when the static layer was drawn
+		uint32_t shadow_generation = -1U; //atlas generation when the static layer was drawn
+		bool dynamic_valid = false; //the full map is drawn for...
+		std::vector< std::pair< Scene::Object const *, glm::mat4 > > dynamic_casters; //...these dynamic casters, in these places
+		uint32_t last_used = 0; //frame_number when the lamp last needed a shadow map
+	};
+	std::vector< ShadowCacheEntry > shadow_cache;
+	std::vector< std::pair< Scene::Object const *, glm::mat4 > > dynamic_casters; //(scratch space for checking shadow_cache)
+	uint32_t frame_number = 0;
+	//shadow map update schedule (see draw()):
+	uint32_t shadow_update_budget = 4; //shadow maps redrawn per frame (not counting ones that can't wait)
+	uint32_t distant_shadow_interval = 4; //frames between chances for distant lights to update
+	float near_shadow_distance = 4.0f; //lights nearer than this (to the player or camera) may update every frame
+	//counts for the last frame drawn:
+	struct ShadowCacheStats {
+		uint32_t hits = 0; //shadow maps reused as-is
+		uint32_t dynamic_renders = 0; //shadow maps redrawn (dynamic casters over the static layer)
+		uint32_t static_renders = 0; //...of which needed the static layer redrawn first
+		uint32_t postponed = 0; //shadow maps out of date, but left for a later frame
+	} shadow_cache_stats;
+
+	//draw all the shadow map layers redrawn in a frame with one submission per atlas (see Scene::LayeredPass), rather than one per light:
+	bool layered_shadows = true; //(toggled with L)
+	Scene::LayeredPass layered_pass; //(kept to reuse its memory)
+	std::vector< ShadowAtlas::Tile > layer_tiles; //(where each of layered_pass's layers goes)
+
+	//light level of detail (see draw()): enemy lights far away or covering little of the screen are lit without a shadow map,
+	// and ones farther or smaller still -- or pointing straight down, like the scouts' -- only as a decal on the floor:
+	float unshadowed_light_distance = 8.0f;
+	float unshadowed_light_screen_fraction = 0.02f;
+	float decal_light_distance = 14.0f;
+	float decal_light_screen_fraction = 0.004f;
+	glm::vec3 decal_albedo = glm::vec3(0.6f); //(decals light the floor as if it were this color)
+	float floor_height = 0.0f; //top of the floor (set by new_level)
+	//counts for the last frame drawn:
+	struct LightDetailStats {
+		uint32_t shadowed = 0;
+		uint32_t unshadowed = 0; //(including lights that found no room in the shadow atlas)
+		uint32_t decals = 0;
+	} light_detail_stats;
+
+	//occlusion queries for enemy lights (see draw()): each light's volume is tested against the camera's depth, and
+	// lights whose last result saw no samples are left out -- no shadow map update, no lighting pass -- but still tested.
+	//Results are read a frame or more later, only once available; until then, the light's shadow map update and
+	// (deferred) lighting pass are drawn conditional on the query in flight:
+	struct LightQuery {
+		Scene::Lamp const *lamp = nullptr; //lamp whose volume is tested (nullptr for unused entries)
+		GLuint query = 0; //(GL_ANY_SAMPLES_PASSED)
+		bool pending = false; //issued, and the result not read yet
+		bool visible = true; //last result read
+		bool conditional_shadow = false; //the lamp's cached shadow map was drawn conditional on the pending query (so perhaps not at all)
+		uint32_t last_used = 0; //frame_number when the lamp was last a candidate
+	};
+	std::vector< LightQuery > light_queries;
+	bool occlusion_queries = true; //(toggled with O)
+	uint32_t occluded_lights = 0; //lights left out as hidden, in the last frame drawn
+
+	//light with a G-buffer pass plus a screen-space pass per light, rather than one scene pass with all lights:
+	// (toggled with TAB; both produce the same image)
+	bool deferred_lighting = false;
+	bool stencil_light_volumes = true; //(deferred) limit each light pass to pixels inside the light's volume, not just its screen rectangle
+	bool depth_prepass = true; //draw camera depth (depth_program) first, so the color-writing pass shades each pixel once
+	//how the maze walls shadow spot lights (cycled with G):
+	enum WallShadows : uint32_t {
+		WallShadowMaps, //walls drawn into shadow maps
+		WallShadowPolygons, //only the wall faces in each lamp's visibility polygon drawn into its shadow map (lamps between wall bottom and top; others as WallShadowMaps)
+		WallShadowGrid, //wall grid ray-marched in the lighting shader; shadow maps hold only dynamic casters
+	} wall_shadows = WallShadowMaps;
+	GLuint wall_tex = 0; //walls, one texel per cell (GL_R8)
+	std::vector< glm::vec3 > wall_mask; //(scratch space for WallShadowPolygons triangles)
+	GLuint wall_mask_buffer = 0; //...and the buffer they are streamed through
+	GLuint wall_mask_vao = 0; //(for depth_program)
+	VisibilityPolygon lamp_polygon; //(scratch space for WallShadowPolygons)
+
+	//walls, for finding what guards see (and for WallShadowPolygons):
+	VisibilityGrid visibility;
 
 	float camera_spin = 0.0f;
 	float spot_spin = 0.0f;
@@ -61,4 +174,7 @@ struct GameMode : public Mode {
 	
 	std::vector<Enemy*> enemies;
 	std::vector<Scene::Object *> objects;
+	//baked walls and floor (GL buffers are kept across levels):
+	Scene::StaticBatch walls_batch;
+	Scene::StaticBatch floor_batch;
 };
@@ -10,6 +10,7 @@
 #include <string>
 #include <set>
 #include <cstddef>
+#include <algorithm>
 
 MeshBuffer::MeshBuffer(std::string const &filename) {
 	glGenBuffers(1, &vbo);
@@ -17,6 +18,7 @@ MeshBuffer::MeshBuffer(std::string const &filename) {
 	std::ifstream file(filename, std::ios::binary);
 
 	GLuint total = 0;
+	std::vector< glm::vec3 > positions; //kept to compute per-mesh bounds
 	//read + upload data chunk:
 	if (filename.size() >= 2 && filename.substr(filename.size()-2) == ".p") {
 		struct Vertex {
@@ -31,9 +33,15 @@ MeshBuffer::MeshBuffer(std::string const &filename) {
 		glBindBuffer(GL_ARRAY_BUFFER, vbo);
 		glBufferData(GL_ARRAY_BUFFER, data.size() * sizeof(Vertex), data.data(), GL_STATIC_DRAW);
 		glBindBuffer(GL_ARRAY_BUFFER, 0);
+		vertex_data.assign(reinterpret_cast< char const * >(data.data()), reinterpret_cast< char const * >(data.data() + data.size()));
 
 		total = GLuint(data.size()); //store total for later checks on index
 
+		positions.reserve(data.size());
+		for (auto const &v : data) {
+			positions.emplace_back(v.Position);
+		}
+
 		//store attrib locations:
 		Position = Attrib(3, GL_FLOAT, GL_FALSE, sizeof(Vertex), offsetof(Vertex, Position));
 
@@ -51,9 +59,15 @@ MeshBuffer::MeshBuffer(std::string const &filename) {
 		glBindBuffer(GL_ARRAY_BUFFER, vbo);
 		glBufferData(GL_ARRAY_BUFFER, data.size() * sizeof(Vertex), data.data(), GL_STATIC_DRAW);
 		glBindBuffer(GL_ARRAY_BUFFER, 0);
+		vertex_data.assign(reinterpret_cast< char const * >(data.data()), reinterpret_cast< char const * >(data.data() + data.size()));
 
 		total = GLuint(data.size()); //store total for later checks on index
 
+		positions.reserve(data.size());
+		for (auto const &v : data) {
+			positions.emplace_back(v.Position);
+		}
+
 		//store attrib locations:
 		Position = Attrib(3, GL_FLOAT, GL_FALSE, sizeof(Vertex), offsetof(Vertex, Position));
 		Normal = Attrib(3, GL_FLOAT, GL_FALSE, sizeof(Vertex), offsetof(Vertex, Normal));
@@ -73,9 +87,15 @@ MeshBuffer::MeshBuffer(std::string const &filename) {
 		glBindBuffer(GL_ARRAY_BUFFER, vbo);
 		glBufferData(GL_ARRAY_BUFFER, data.size() * sizeof(Vertex), data.data(), GL_STATIC_DRAW);
 		glBindBuffer(GL_ARRAY_BUFFER, 0);
+		vertex_data.assign(reinterpret_cast< char const * >(data.data()), reinterpret_cast< char const * >(data.data() + data.size()));
 
 		total = GLuint(data.size()); //store total for later checks on index
 
+		positions.reserve(data.size());
+		for (auto const &v : data) {
+			positions.emplace_back(v.Position);
+		}
+
 		//store attrib locations:
 		Position = Attrib(3, GL_FLOAT, GL_FALSE, sizeof(Vertex), offsetof(Vertex, Position));
 		Normal = Attrib(3, GL_FLOAT, GL_FALSE, sizeof(Vertex), offsetof(Vertex, Normal));
@@ -97,9 +117,15 @@ MeshBuffer::MeshBuffer(std::string const &filename) {
 		glBindBuffer(GL_ARRAY_BUFFER, vbo);
 		glBufferData(GL_ARRAY_BUFFER, data.size() * sizeof(Vertex), data.data(), GL_STATIC_DRAW);
 		glBindBuffer(GL_ARRAY_BUFFER, 0);
+		vertex_data.assign(reinterpret_cast< char const * >(data.data()), reinterpret_cast< char const * >(data.data() + data.size()));
 
 		total = GLuint(data.size()); //store total for later checks on index
 
+		positions.reserve(data.size());
+		for (auto const &v : data) {
+			positions.emplace_back(v.Position);
+		}
+
 		//store attrib locations:
 		Position = Attrib(3, GL_FLOAT, GL_FALSE, sizeof(Vertex), offsetof(Vertex, Position));
 		Normal = Attrib(3, GL_FLOAT, GL_FALSE, sizeof(Vertex), offsetof(Vertex, Normal));
@@ -134,6 +160,18 @@ MeshBuffer::MeshBuffer(std::string const &filename) {
 			Mesh mesh;
 			mesh.start = entry.vertex_begin;
 			mesh.count = entry.vertex_end - entry.vertex_begin;
+			if (mesh.count > 0) {
+				mesh.min = mesh.max = positions[entry.vertex_begin];
+				for (uint32_t v = entry.vertex_begin; v < entry.vertex_end; ++v) {
+					mesh.min = glm::min(mesh.min, positions[v]);
+					mesh.max = glm::max(mesh.max, positions[v]);
+				}
+				//sphere around box center (tighter than the box's circumscribed sphere):
+				mesh.center = 0.5f * (mesh.min + mesh.max);
+				for (uint32_t v = entry.vertex_begin; v < entry.vertex_end; ++v) {
+					mesh.radius = std::max(mesh.radius, glm::length(positions[v] - mesh.center));
+				}
+			}
 			bool inserted = meshes.insert(std::make_pair(name, mesh)).second;
 			if (!inserted) {
 				std::cerr << "WARNING: mesh name '" + name + "' in filename '" + filename + "' collides with existing mesh." << std::endl;
@@ -164,7 +202,11 @@ const MeshBuffer::Mesh &MeshBuffer::lookup(std::string const &name) const {
 	return f->second;
 }
 
-GLuint MeshBuffer::make_vao_for_program(GLuint program) const {
+GLuint MeshBuffer::make_vao_for_program(GLuint program, std::set< GLuint > const &external_locations) const {
+	return make_vao_for_buffer(vbo, program, external_locations);
+}
+
+GLuint MeshBuffer::make_vao_for_buffer(GLuint buffer, GLuint program, std::set< GLuint > const &external_locations) const {
 	//create a new vertex array object:
 	GLuint vao = 0;
 	glGenVertexArrays(1, &vao);
@@ -172,7 +214,7 @@ GLuint MeshBuffer::make_vao_for_program(GLuint program) const {
 
 	//Try to bind all attributes in this buffer:
 	std::set< GLuint > bound;
-	glBindBuffer(GL_ARRAY_BUFFER, vbo);
+	glBindBuffer(GL_ARRAY_BUFFER, buffer);
 	auto bind_attribute = [&](char const *name, MeshBuffer::Attrib const &attrib) {
 		if (attrib.size == 0) return; //don't bind empty attribs
 		GLint location = glGetAttribLocation(program, name);
@@ -202,7 +244,7 @@ GLuint MeshBuffer::make_vao_for_program(GLuint program) const {
 		glGetActiveAttrib(program, i, 100, NULL, &size, &type, name);
 		name[99] = '\0';
 		GLint location = glGetAttribLocation(program, name);
-		if (!bound.count(GLuint(location))) {
+		if (!bound.count(GLuint(location)) && !external_locations.count(GLuint(location))) {
 			throw std::runtime_error("ERROR: active attribute '" + std::string(name) + "' in program is not bound.");
 		}
 	}
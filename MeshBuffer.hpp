@@ -1,7 +1,12 @@
 #pragma once
 
 #include "GL.hpp"
+
+#include <glm/glm.hpp>
+
 #include <map>
+#include <set>
+#include <vector>
 
 //"MeshBuffer" holds a collection of meshes loaded from a file
 // (note that meshes in a single collection will share a vbo/vao)
@@ -38,13 +43,25 @@ struct MeshBuffer {
 	struct Mesh {
 		GLuint start = 0;
 		GLuint count = 0;
+		//bounding volumes (in mesh coordinates), computed at load time:
+		glm::vec3 min = glm::vec3(0.0f); //axis-aligned box
+		glm::vec3 max = glm::vec3(0.0f);
+		glm::vec3 center = glm::vec3(0.0f); //sphere
+		float radius = 0.0f;
 	};
 	const Mesh &lookup(std::string const &name) const;
 	
 	//build a vertex array object that links this vbo to attributes to a program:
 	//  will throw if program defines attributes not contained in this buffer
+	//  (except for attributes at 'external_locations', which the caller binds -- e.g., per-instance data)
 	//  and warn if this buffer contains attributes not active in the program
-	GLuint make_vao_for_program(GLuint program) const;
+	GLuint make_vao_for_program(GLuint program, std::set< GLuint > const &external_locations = std::set< GLuint >()) const;
+	//same, but for another buffer laid out like this one (e.g., pre-transformed copies of these meshes):
+	GLuint make_vao_for_buffer(GLuint buffer, GLuint program, std::set< GLuint > const &external_locations = std::set< GLuint >()) const;
+
+	//copy of the vertex data uploaded to vbo (interleaved as described by the Attribs above):
+	// (kept so that meshes can be pre-transformed on the CPU; see Scene::bake)
+	std::vector< char > vertex_data;
 
 	//internals:
 	std::map< std::string, Mesh > meshes;
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <new>
+#include <utility>
+#include <type_traits>
+#include <cassert>
+#include <cstddef>
+
+//"Pool" hands out fixed-size slots for objects of type T from a list of slabs:
+// - pointers stay valid until the object is destroyed (slabs never move)
+// - destroyed slots go on a free list and are reused by later create() calls
+// - reset() forgets every live object at once (without running destructors) but keeps the slabs for reuse
+
+template< typename T, size_t SlabSize = 256 >
+struct Pool {
+	Pool() = default;
+	Pool(Pool const &) = delete;
+	Pool &operator=(Pool const &) = delete;
+
+	//construct a new T in a free slot:
+	template< typename... Args >
+	T *create(Args&&... args) {
+		Slot *slot = free_list;
+		if (slot) {
+			free_list = slot->next_free;
+		} else {
+			if (next_slab_slot == SlabSize) {
+				//current slab is full; move on to the next one (allocating it if needed):
+				if (slabs_used == slabs.size()) {
+					slabs.emplace_back(new Slot[SlabSize]);
+				}
+				++slabs_used;
+				next_slab_slot = 0;
+			}
+			slot = &slabs[slabs_used - 1][next_slab_slot];
+			++next_slab_slot;
+		}
+		T *t = new (&slot->storage) T(std::forward< Args >(args)...);
+		++live;
+		if (live > peak) peak = live;
+		return t;
+	}
+
+	//destroy a T allocated from this pool and put its slot on the free list:
+	void destroy(T *t) {
+		assert(t && "Can't destroy null from a pool.");
+		assert(live > 0);
+		t->~T();
+		Slot *slot = reinterpret_cast< Slot * >(t);
+		slot->next_free = free_list;
+		free_list = slot;
+		--live;
+	}
+
+	//forget all live objects in O(1); destructors are *not* run, so callers must release anything they own first:
+	void reset() {
+		free_list = nullptr;
+		slabs_used = 0;
+		next_slab_slot = SlabSize;
+		live = 0;
+	}
+
+	//counters:
+	size_t live = 0; //objects currently allocated
+	size_t peak = 0; //most objects ever allocated at once
+	size_t bytes() const { return slabs.size() * SlabSize * sizeof(Slot); } //memory held by slabs
+
+	//internals:
+	union Slot {
+		typename std::aligned_storage< sizeof(T), alignof(T) >::type storage;
+		Slot *next_free;
+	};
+	std::vector< std::unique_ptr< Slot[] > > slabs;
+	size_t slabs_used = 0; //slabs that have handed out slots since the last reset
+	size_t next_slab_slot = SlabSize; //next never-used slot in slabs[slabs_used-1]
+	Slot *free_list = nullptr;
+};
@@ -1,4 +1,6 @@
 #include "Scene.hpp"
+#include "MeshBuffer.hpp"
+#include "SpatialIndex.hpp"
 #include "read_chunk.hpp"
 
 #include <glm/gtc/matrix_transform.hpp>
@@ -6,6 +8,12 @@
 
 #include <iostream>
 #include <fstream>
+#include <type_traits>
+#include <algorithm>
+#include <stdexcept>
+#include <cstddef>
+#include <cstring>
+#include <cmath>
 
 glm::mat4 Scene::Transform::make_local_to_parent() const {
 	return glm::mat4( //translate
@@ -43,22 +51,70 @@ glm::mat4 Scene::Transform::make_parent_to_local() const {
 	);
 }
 
-glm::mat4 Scene::Transform::make_local_to_world() const {
+void Scene::Transform::update_cache() const {
+	//make sure ancestors are up to date (this may mark this transform as dirty):
+	if (parent) parent->update_cache();
+
+	if (!cache.dirty
+	 && cache.position == position
+	 && cache.rotation == rotation
+	 && cache.scale == scale) return;
+
+	cache.position = position;
+	cache.rotation = rotation;
+	cache.scale = scale;
+
 	if (parent) {
-		return parent->make_local_to_world() * make_local_to_parent();
+		cache.local_to_world = parent->cache.local_to_world * make_local_to_parent();
+		cache.world_to_local = make_parent_to_local() * parent->cache.world_to_local;
 	} else {
-		return make_local_to_parent();
+		cache.local_to_world = make_local_to_parent();
+		cache.world_to_local = make_parent_to_local();
 	}
-}
 
-glm::mat4 Scene::Transform::make_world_to_local() const {
-	if (parent) {
-		return make_parent_to_local() * parent->make_world_to_local();
+	//track uniform scale down the hierarchy so normals can skip the general inverse:
+	float parent_uniform_scale = (parent ? parent->cache.uniform_scale : 1.0f);
+	if (parent_uniform_scale != 0.0f && scale.x == scale.y && scale.y == scale.z && scale.x != 0.0f) {
+		cache.uniform_scale = parent_uniform_scale * scale.x;
+		//rotation * s has inverse-transpose rotation / s == (rotation * s) / s^2:
+		cache.normal_to_world = glm::mat3(cache.local_to_world) * (1.0f / (cache.uniform_scale * cache.uniform_scale));
 	} else {
-		return make_parent_to_local();
+		cache.uniform_scale = 0.0f;
+		cache.normal_to_world = glm::inverse(glm::transpose(glm::mat3(cache.local_to_world)));
+	}
+
+	cache.dirty = false;
+
+	//descendants were computed relative to the old matrices:
+	for (Transform *child = last_child; child != nullptr; child = child->prev_sibling) {
+		child->invalidate();
+	}
+}
+
+void Scene::Transform::invalidate() const {
+	//if already dirty, children will be invalidated when this transform is next updated:
+	if (cache.dirty) return;
+	cache.dirty = true;
+	for (Transform *child = last_child; child != nullptr; child = child->prev_sibling) {
+		child->invalidate();
 	}
 }
 
+glm::mat4 const &Scene::Transform::make_local_to_world() const {
+	update_cache();
+	return cache.local_to_world;
+}
+
+glm::mat4 const &Scene::Transform::make_world_to_local() const {
+	update_cache();
+	return cache.world_to_local;
+}
+
+glm::mat3 const &Scene::Transform::make_normal_to_world() const {
+	update_cache();
+	return cache.normal_to_world;
+}
+
 void Scene::Transform::DEBUG_assert_valid_pointers() const {
 	if (parent == nullptr) {
 		//if no parent, can't have siblings:
@@ -98,11 +154,62 @@ void Scene::Transform::set_parent(Transform *new_parent, Transform *before) {
 		}
 		if (prev_sibling) prev_sibling->next_sibling = this;
 	}
+	invalidate();
 	DEBUG_assert_valid_pointers();
 }
 
 //---------------------------
 
+bool Scene::Object::make_world_bounds(glm::vec3 *min_, glm::vec3 *max_) const {
+	assert(min_ && max_);
+	if (!has_bounds) return false;
+	glm::mat4 const &local_to_world = transform->make_local_to_world();
+	//transform box center and extents (extents by the absolute value of the linear part):
+	glm::vec3 center = glm::vec3(local_to_world * glm::vec4(0.5f * (bounds_min + bounds_max), 1.0f));
+	glm::vec3 extent = 0.5f * (bounds_max - bounds_min);
+	glm::vec3 world_extent =
+		  glm::abs(glm::vec3(local_to_world[0])) * extent.x
+		+ glm::abs(glm::vec3(local_to_world[1])) * extent.y
+		+ glm::abs(glm::vec3(local_to_world[2])) * extent.z;
+	*min_ = center - world_extent;
+	*max_ = center + world_extent;
+	return true;
+}
+
+//---------------------------
+
+Scene::Frustum::Frustum(glm::mat4 const &world_to_clip) {
+	//planes from rows of world_to_clip (Gribb & Hartmann); clip space is inside when -w <= x,y,z <= w:
+	glm::mat4 rows = glm::transpose(world_to_clip);
+	planes[0] = rows[3] + rows[0]; //left
+	planes[1] = rows[3] - rows[0]; //right
+	planes[2] = rows[3] + rows[1]; //bottom
+	planes[3] = rows[3] - rows[1]; //top
+	planes[4] = rows[3] + rows[2]; //near
+	planes[5] = rows[3] - rows[2]; //far (degenerate -- never culls -- for infinite perspective)
+}
+
+bool Scene::Frustum::intersects_box(glm::vec3 const &min, glm::vec3 const &max) const {
+	glm::vec3 center = 0.5f * (min + max);
+	glm::vec3 extent = 0.5f * (max - min);
+	for (uint32_t i = 0; i < 6; ++i) {
+		glm::vec3 normal = glm::vec3(planes[i]);
+		//distance from center to plane, scaled by |normal|, vs. projected radius of box:
+		if (glm::dot(normal, center) + planes[i].w < -glm::dot(glm::abs(normal), extent)) return false;
+	}
+	return true;
+}
+
+bool Scene::Frustum::intersects_sphere(glm::vec3 const &center, float radius) const {
+	for (uint32_t i = 0; i < 6; ++i) {
+		glm::vec3 normal = glm::vec3(planes[i]);
+		if (glm::dot(normal, center) + planes[i].w < -radius * glm::length(normal)) return false;
+	}
+	return true;
+}
+
+//---------------------------
+
 glm::mat4 Scene::Lamp::make_projection() const {
 	return glm::perspective( fov, 1.0f, clip_start, clip_end );
 }
@@ -117,8 +224,8 @@ glm::mat4 Scene::Camera::make_projection() const {
 
 //templated helper functions to avoid having to write the same new/delete code three times:
 template< typename T, typename... Args >
-T *list_new(T * &first, Args&&... args) {
-	T *t = new T(std::forward< Args >(args)...); //"perfect forwarding"
+T *list_new(Pool< T > &pool, T * &first, Args&&... args) {
+	T *t = pool.create(std::forward< Args >(args)...); //"perfect forwarding"
 	if (first) {
 		t->alloc_next = first;
 		first->alloc_prev_next = &t->alloc_next;
@@ -129,7 +236,7 @@ T *list_new(T * &first, Args&&... args) {
 }
 
 template< typename T >
-void list_delete(T * t) {
+void list_delete(Pool< T > &pool, T * t) {
 	assert(t && "It is invalid to delete a null scene object [yes this is different than 'delete']");
 	assert(t->alloc_prev_next);
 	if (t->alloc_next) {
@@ -139,48 +246,60 @@ void list_delete(T * t) {
 	//PARANOIA:
 	t->alloc_next = nullptr;
 	t->alloc_prev_next = nullptr;
+	pool.destroy(t);
 }
 
 Scene::Transform *Scene::new_transform() {
-	return list_new< Scene::Transform >(first_transform);
+	return list_new< Scene::Transform >(transform_pool, first_transform);
 }
 
 void Scene::delete_transform(Scene::Transform *transform) {
-	list_delete< Scene::Transform >(transform);
+	list_delete< Scene::Transform >(transform_pool, transform);
 }
 
 Scene::Object *Scene::new_object(Scene::Transform *transform) {
 	assert(transform && "Scene::Object must be attached to a transform.");
-	return list_new< Scene::Object >(first_object, transform);
+	render_queues_dirty = true;
+	return list_new< Scene::Object >(object_pool, first_object, transform);
+}
+
+void Scene::set_program(Scene::Object *object, Object::ProgramType type, Object::ProgramInfo const &info) {
+	assert(object);
+	assert(type < Object::ProgramTypes);
+	object->programs[type] = info;
+	render_queues_dirty = true;
 }
 
 void Scene::delete_object(Scene::Object *object) {
-	list_delete< Scene::Object >(object);
+	render_queues_dirty = true;
+	if (object->batch) ++static_version;
+	if (spatial_index) spatial_index->remove(object);
+	list_delete< Scene::Object >(object_pool, object);
 }
 
 Scene::Lamp *Scene::new_lamp(Scene::Transform *transform) {
 	assert(transform && "Scene::Lamp must be attached to a transform.");
-	return list_new< Scene::Lamp >(first_lamp, transform);
+	return list_new< Scene::Lamp >(lamp_pool, first_lamp, transform);
 }
 
 void Scene::delete_lamp(Scene::Lamp *object) {
-	list_delete< Scene::Lamp >(object);
+	list_delete< Scene::Lamp >(lamp_pool, object);
 }
 
 Scene::Camera *Scene::new_camera(Scene::Transform *transform) {
 	assert(transform && "Scene::Camera must be attached to a transform.");
-	return list_new< Scene::Camera >(first_camera, transform);
+	return list_new< Scene::Camera >(camera_pool, first_camera, transform);
 }
 
 void Scene::delete_camera(Scene::Camera *object) {
-	list_delete< Scene::Camera >(object);
+	list_delete< Scene::Camera >(camera_pool, object);
 }
 
 void Scene::draw(Scene::Camera const *camera, Object::ProgramType program_type) const {
 	assert(camera && "Must have a camera to draw scene from.");
 	assert(program_type < Object::ProgramTypes);
 
-	glm::mat4 world_to_camera = camera->transform->make_world_to_local();
+	glm::mat4 const &world_to_camera = camera->transform->make_world_to_local();
 	glm::mat4 world_to_clip = camera->make_projection() * world_to_camera;
 
 	draw(world_to_clip, program_type);
@@ -190,59 +309,364 @@ void Scene::draw(Scene::Lamp const *lamp, Object::ProgramType program_type) cons
 	assert(lamp && "Must have a lamp to draw scene from.");
 	assert(program_type < Object::ProgramTypes);
 
-	glm::mat4 world_to_lamp = lamp->transform->make_world_to_local();
+	glm::mat4 const &world_to_lamp = lamp->transform->make_world_to_local();
 	glm::mat4 world_to_clip = lamp->make_projection() * world_to_lamp;
 
 	draw(world_to_clip, program_type);
 }
 
 
+Scene::DrawState::DrawState(Object::ProgramInfo const &info) : program(info.program), vao(info.vao),
+	instanced_program(info.instanced_program), instanced_vao(info.instanced_vao) {
+	for (uint32_t i = 0; i < Object::ProgramInfo::TextureCount; ++i) {
+		textures[i] = info.textures[i];
+	}
+}
+
+bool Scene::DrawState::operator==(DrawState const &other) const {
+	if (program != other.program || vao != other.vao) return false;
+	for (uint32_t i = 0; i < Object::ProgramInfo::TextureCount; ++i) {
+		if (textures[i] != other.textures[i]) return false;
+	}
+	if (instanced_program != other.instanced_program || instanced_vao != other.instanced_vao) return false;
+	return true;
+}
+
+bool Scene::DrawState::operator<(DrawState const &other) const {
+	//programs are the most expensive to switch, so they are the primary key:
+	if (program != other.program) return program < other.program;
+	if (vao != other.vao) return vao < other.vao;
+	for (uint32_t i = 0; i < Object::ProgramInfo::TextureCount; ++i) {
+		if (textures[i] != other.textures[i]) return textures[i] < other.textures[i];
+	}
+	if (instanced_program != other.instanced_program) return instanced_program < other.instanced_program;
+	return instanced_vao < other.instanced_vao;
+}
+
+void Scene::update_render_queues() const {
+	if (render_queues_dirty) {
+		for (uint32_t t = 0; t < Object::ProgramTypes; ++t) {
+			std::vector< DrawItem > &queue = render_queues[t];
+			queue.clear();
+			//every object is queued (even without a program), so each has a queue position for the spatial index to report:
+			for (Object const *object = first_object; object != nullptr; object = object->alloc_next) {
+				queue.emplace_back();
+				queue.back().object = object;
+				queue.back().state = DrawState(object->programs[t]);
+			}
+			std::stable_sort(queue.begin(), queue.end(), [](DrawItem const &a, DrawItem const &b) {
+				return a.state < b.state;
+			});
+			render_queue_drawable[t] = 0;
+			for (uint32_t i = 0; i < queue.size(); ++i) {
+				queue[i].object->queue_positions[t] = i;
+				if (queue[i].state.program != 0) ++render_queue_drawable[t];
+			}
+		}
+		render_queues_dirty = false;
+	}
+}
+
+std::vector< Scene::DrawItem > &Scene::update_render_queue(Object::ProgramType program_type) const {
+	assert(program_type < Object::ProgramTypes);
+	update_render_queues();
+	return render_queues[program_type];
+}
+
 void Scene::draw(glm::mat4 const &world_to_clip, Object::ProgramType program_type) const {
 	assert(program_type < Object::ProgramTypes);
 
-	for (Scene::Object *object = first_object; object != nullptr; object = object->alloc_next) {
+	draw_passes.resize(1);
+	draw_passes[0].world_to_clip = world_to_clip;
+	draw_passes[0].program_type = program_type;
+	draw_passes[0].exclude = nullptr;
+	draw_passes[0].filter = Pass::AllObjects;
 
-		//don't draw if no program of this type attached to object:
-		if (object->programs[program_type].program == 0) continue;
+	prepare(&draw_passes);
+	submit(draw_passes[0]);
+}
 
-		glm::mat4 local_to_world = object->transform->make_local_to_world();
+void Scene::prepare(std::vector< Pass > *passes_) const {
+	assert(passes_);
+	std::vector< Pass > &passes = *passes_;
 
-		//compute modelview+projection (object space to clip space) matrix for this object:
-		glm::mat4 mvp = world_to_clip * local_to_world;
+	//everything that writes to the scene happens here, before any worker starts:
+	update_render_queues();
+	for (Object const *object = first_object; object != nullptr; object = object->alloc_next) {
+		object->transform->make_local_to_world(); //(brings cached matrices of the transform and its ancestors up to date)
+	}
+	update_spatial_index();
 
-		//compute modelview (object space to camera local space) matrix for this object:
-		glm::mat4x3 mv = glm::mat4x3(local_to_world);
+	if (single_threaded_prepare) {
+		for (Pass &pass : passes) {
+			prepare_pass(&pass);
+		}
+	} else {
+		prepare_pool.run(uint32_t(passes.size()), [this,&passes](uint32_t i){
+			prepare_pass(&passes[i]);
+		});
+	}
 
-		//NOTE: inverse cancels out transpose unless there is scale involved
-		glm::mat3 itmv = glm::inverse(glm::transpose(glm::mat3(mv)));
+	//upload instance data for all passes at once:
+	GLuint total = 0;
+	for (Pass &pass : passes) {
+		pass.instance_base = total;
+		total += GLuint(pass.instances.size());
+	}
+	if (total != 0) {
+		if (instance_buffer == 0) glGenBuffers(1, &instance_buffer);
+		glBindBuffer(GL_ARRAY_BUFFER, instance_buffer);
+		glBufferData(GL_ARRAY_BUFFER, total * sizeof(Instance), NULL, GL_STREAM_DRAW);
+		for (Pass const &pass : passes) {
+			if (pass.instances.empty()) continue;
+			glBufferSubData(GL_ARRAY_BUFFER, pass.instance_base * sizeof(Instance), pass.instances.size() * sizeof(Instance), pass.instances.data());
+		}
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+	}
+}
 
-		//set up program uniforms:
-		Object::ProgramInfo const &info = object->programs[program_type];
-		glUseProgram(info.program);
-		if (info.mvp_mat4 != -1U) {
-			glUniformMatrix4fv(info.mvp_mat4, 1, GL_FALSE, glm::value_ptr(mvp));
+void Scene::update_spatial_index() const {
+	if (!spatial_index) return;
+	for (Object const *object = first_object; object != nullptr; object = object->alloc_next) {
+		glm::vec3 min(0.0f), max(0.0f);
+		bool bounded = object->make_world_bounds(&min, &max);
+		spatial_index->update(object, bounded, min, max); //(cheap if the bounds didn't change)
+	}
+	spatial_index->refresh();
+}
+
+void Scene::prepare_pass(Pass *pass_) const {
+	assert(pass_);
+	Pass &pass = *pass_;
+	Object::ProgramType program_type = pass.program_type;
+	assert(program_type < Object::ProgramTypes);
+
+	pass.batches.clear();
+	pass.draws.clear();
+	pass.ranges.clear();
+	pass.instances.clear();
+	pass.objects_drawn = 0;
+
+	glm::mat4 const &world_to_clip = pass.world_to_clip;
+	Frustum frustum(world_to_clip);
+
+	auto excluded = [&pass](Object const *object) {
+		if (object == pass.exclude) return true;
+		if (pass.filter == Pass::StaticObjects) return object->batch == nullptr;
+		if (pass.filter == Pass::DynamicObjects) return object->batch != nullptr;
+		return false;
+	};
+
+	if (spatial_index) {
+		//only queue the objects the index finds inside the frustum (kept in render queue order):
+		pass.found.clear();
+		spatial_index->query_frustum(frustum, &pass.found);
+		pass.found_positions.clear();
+		for (Object const *object : pass.found) {
+			if (excluded(object)) continue;
+			pass.found_positions.emplace_back(object->queue_positions[program_type]);
 		}
-		if (info.mv_mat4x3 != -1U) {
-			glUniformMatrix4x3fv(info.mv_mat4x3, 1, GL_FALSE, glm::value_ptr(mv));
+		std::sort(pass.found_positions.begin(), pass.found_positions.end());
+		pass.items.clear();
+		for (uint32_t position : pass.found_positions) {
+			pass.items.emplace_back(render_queues[program_type][position]);
 		}
-		if (info.itmv_mat3 != -1U) {
-			glUniformMatrix3fv(info.itmv_mat3, 1, GL_FALSE, glm::value_ptr(itmv));
+	} else {
+		pass.items = render_queues[program_type];
+	}
+
+	std::vector< DrawItem > &queue = pass.items;
+
+	//within each run of identical state, sort by mesh (so instances are adjacent) and then front-to-back (helps early depth rejection):
+	for (auto begin = queue.begin(); begin != queue.end(); /* later */) {
+		auto end = begin + 1;
+		while (end != queue.end() && end->state == begin->state) ++end;
+		if (begin->state.program != 0) {
+			for (auto item = begin; item != end; ++item) {
+				glm::vec3 min, max;
+				if (excluded(item->object)) {
+					item->visible = false;
+				} else if (spatial_index) {
+					item->visible = true; //(already tested by the index)
+				} else if (item->object->make_world_bounds(&min, &max)) {
+					item->visible = frustum.intersects_box(min, max);
+				} else {
+					item->visible = true;
+				}
+				glm::vec4 const &origin = item->object->transform->make_local_to_world()[3];
+				item->depth = (world_to_clip * origin).w;
+			}
+			std::sort(begin, end, [program_type](DrawItem const &a, DrawItem const &b) {
+				Object::ProgramInfo const &ai = a.object->programs[program_type];
+				Object::ProgramInfo const &bi = b.object->programs[program_type];
+				if (ai.start != bi.start) return ai.start < bi.start;
+				if (ai.count != bi.count) return ai.count < bi.count;
+				return a.depth < b.depth;
+			});
 		}
+		begin = end;
+	}
+
+	//split queue into batches of items that draw the same mesh with the same state:
+	for (uint32_t begin = 0; begin < queue.size(); /* later */) {
+		Object::ProgramInfo const &info = queue[begin].object->programs[program_type];
+		bool can_instance = (info.instanced_program != 0 && !info.set_uniforms);
+		uint32_t visible = (queue[begin].visible ? 1 : 0);
+		uint32_t end = begin + 1;
+		while (end < queue.size() && queue[end].state == queue[begin].state) {
+			Object::ProgramInfo const &next = queue[end].object->programs[program_type];
+			if (next.start != info.start || next.count != info.count) break;
+			if (next.set_uniforms) can_instance = false;
+			if (queue[end].visible) ++visible;
+			++end;
+		}
+
+		//don't draw if no program of this type attached, nothing to draw, or nothing visible:
+		if (info.program != 0 && info.count != 0 && visible != 0) {
+			Pass::Batch batch;
+			batch.info = &info;
+			batch.first_instance = -1U;
+			batch.instance_count = visible;
+			batch.draws_begin = uint32_t(pass.draws.size());
+			if (can_instance && visible > 1) {
+				batch.first_instance = uint32_t(pass.instances.size());
+				for (uint32_t i = begin; i < end; ++i) {
+					if (!queue[i].visible) continue;
+					Transform const *transform = queue[i].object->transform;
+					glm::mat4 const &local_to_world = transform->make_local_to_world();
+					pass.instances.emplace_back();
+					pass.instances.back().object_to_clip = world_to_clip * local_to_world;
+					pass.instances.back().object_to_light = glm::mat4x3(local_to_world);
+					pass.instances.back().normal_to_light = transform->make_normal_to_world();
+				}
+			} else {
+				for (uint32_t i = begin; i < end; ++i) {
+					if (!queue[i].visible) continue;
+					Object const *object = queue[i].object;
+					Object::ProgramInfo const &object_info = object->programs[program_type];
+
+					uint32_t ranges_begin = uint32_t(pass.ranges.size());
+					if (object->batch) {
+						//draw only the cells of the batch inside the frustum, merging neighboring cells into one call:
+						for (StaticBatch::Range const &range : object->batch->ranges) {
+							if (!frustum.intersects_box(range.min, range.max)) continue;
+							GLuint start = object_info.start + range.start;
+							if (pass.ranges.size() > ranges_begin && pass.ranges.back().start + pass.ranges.back().count == start) {
+								pass.ranges.back().count += range.count;
+							} else {
+								pass.ranges.emplace_back();
+								pass.ranges.back().start = start;
+								pass.ranges.back().count = range.count;
+							}
+						}
+						if (pass.ranges.size() == ranges_begin) continue;
+					} else {
+						pass.ranges.emplace_back();
+						pass.ranges.back().start = object_info.start;
+						pass.ranges.back().count = object_info.count;
+					}
+
+					glm::mat4 const &local_to_world = object->transform->make_local_to_world();
+
+					pass.draws.emplace_back();
+					Pass::Draw &draw = pass.draws.back();
+					draw.object = object;
+					//compute modelview+projection (object space to clip space) matrix for this object:
+					draw.mvp = world_to_clip * local_to_world;
+					//compute modelview (object space to camera local space) matrix for this object:
+					draw.mv = glm::mat4x3(local_to_world);
+					//inverse-transpose of mv (cached by the transform; cheap when scale is uniform):
+					draw.itmv = object->transform->make_normal_to_world();
+					draw.ranges_begin = ranges_begin;
+					draw.ranges_end = uint32_t(pass.ranges.size());
+				}
+			}
+			batch.draws_end = uint32_t(pass.draws.size());
+			if (batch.first_instance != -1U || batch.draws_end != batch.draws_begin) {
+				pass.batches.emplace_back(batch);
+			}
+			pass.objects_drawn += (batch.first_instance != -1U ? batch.instance_count : batch.draws_end - batch.draws_begin);
+		}
+		begin = end;
+	}
+	pass.objects_culled = render_queue_drawable[program_type] - pass.objects_drawn;
+}
+
+void Scene::submit(Pass const &pass) const {
+	assert(pass.program_type < Object::ProgramTypes);
 
-		if (info.set_uniforms) info.set_uniforms();
+	//GL state set by the previous batch (used to skip redundant binds):
+	GLuint bound_program = 0;
+	GLuint bound_vao = -1U; //(vao zero is a valid thing to bind)
+	GLuint bound_textures[Object::ProgramInfo::TextureCount] = {0,0,0,0};
 
-		//set up program textures:
+	auto bind_state = [&](GLuint program, GLuint vao, Object::ProgramInfo const &info) {
+		if (program != bound_program) {
+			glUseProgram(program);
+			bound_program = program;
+		}
 		for (uint32_t i = 0; i < Object::ProgramInfo::TextureCount; ++i) {
-			if (info.textures[i] != 0) {
+			if (info.textures[i] != 0 && info.textures[i] != bound_textures[i]) {
 				glActiveTexture(GL_TEXTURE0 + i);
 				glBindTexture(GL_TEXTURE_2D, info.textures[i]);
+				bound_textures[i] = info.textures[i];
 			}
 		}
+		if (vao != bound_vao) {
+			glBindVertexArray(vao);
+			bound_vao = vao;
+		}
+	};
+
+	for (Pass::Batch const &batch : pass.batches) {
+		Object::ProgramInfo const &batch_info = *batch.info;
+
+		if (batch.first_instance != -1U) {
+			bind_state(batch_info.instanced_program, batch_info.instanced_vao, batch_info);
+
+			//point per-instance attributes at this batch's slice of the instance buffer:
+			glBindBuffer(GL_ARRAY_BUFFER, instance_buffer);
+			GLbyte *base = (GLbyte *)0 + (pass.instance_base + batch.first_instance) * sizeof(Instance);
+			auto bind_columns = [&](GLuint location, GLint rows, GLuint columns, size_t offset) {
+				for (GLuint c = 0; c < columns; ++c) {
+					glVertexAttribPointer(location + c, rows, GL_FLOAT, GL_FALSE, sizeof(Instance), base + offset + c * rows * sizeof(float));
+					glEnableVertexAttribArray(location + c);
+					glVertexAttribDivisor(location + c, 1);
+				}
+			};
+			bind_columns(InstanceObjectToClipLocation, 4, 4, offsetof(Instance, object_to_clip));
+			bind_columns(InstanceObjectToLightLocation, 3, 4, offsetof(Instance, object_to_light));
+			bind_columns(InstanceNormalToLightLocation, 3, 3, offsetof(Instance, normal_to_light));
+			glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+			glDrawArraysInstanced(GL_TRIANGLES, batch_info.start, batch_info.count, batch.instance_count);
+			continue;
+		}
+
+		bind_state(batch_info.program, batch_info.vao, batch_info);
+
+		for (uint32_t d = batch.draws_begin; d < batch.draws_end; ++d) {
+			Pass::Draw const &draw = pass.draws[d];
+			Object::ProgramInfo const &info = draw.object->programs[pass.program_type];
+
+			//set up program uniforms:
+			if (info.mvp_mat4 != -1U) {
+				glUniformMatrix4fv(info.mvp_mat4, 1, GL_FALSE, glm::value_ptr(draw.mvp));
+			}
+			if (info.mv_mat4x3 != -1U) {
+				glUniformMatrix4x3fv(info.mv_mat4x3, 1, GL_FALSE, glm::value_ptr(draw.mv));
+			}
+			if (info.itmv_mat3 != -1U) {
+				glUniformMatrix3fv(info.itmv_mat3, 1, GL_FALSE, glm::value_ptr(draw.itmv));
+			}
 
-		glBindVertexArray(info.vao);
+			if (info.set_uniforms) info.set_uniforms();
 
-		//draw the object:
-		glDrawArrays(GL_TRIANGLES, info.start, info.count);
+			//draw the object:
+			for (uint32_t r = draw.ranges_begin; r < draw.ranges_end; ++r) {
+				glDrawArrays(GL_TRIANGLES, pass.ranges[r].start, pass.ranges[r].count);
+			}
+		}
 	}
 
 	//unbind any still bound textures and go back to active texture unit zero:
@@ -253,16 +677,350 @@ void Scene::draw(glm::mat4 const &world_to_clip, Object::ProgramType program_typ
 	glActiveTexture(GL_TEXTURE0);
 }
 
+void Scene::prepare_layered(LayeredPass *layered_) const {
+	assert(layered_);
+	LayeredPass &layered = *layered_;
+	assert(layered.layers.size() <= 32 && "Layer masks have 32 bits.");
+
+	layered.draws.clear();
+	layered.ranges.clear();
+	layered.objects.clear();
+	if (layered.layers.empty()) return;
+	Object::ProgramType program_type = layered.layers[0]->program_type;
+	layered.program_type = program_type;
+
+	//gather the objects visible in each layer:
+	std::vector< Frustum > frustums;
+	frustums.reserve(layered.layers.size());
+	for (uint32_t l = 0; l < layered.layers.size(); ++l) {
+		Pass const &pass = *layered.layers[l];
+		assert(pass.program_type == program_type && "Layers must share a program type.");
+		frustums.emplace_back(pass.world_to_clip);
+		for (DrawItem const &item : pass.items) {
+			if (!item.visible) continue;
+			Object::ProgramInfo const &info = item.object->programs[program_type];
+			if (info.program == 0 || info.count == 0) continue;
+			layered.objects.emplace_back(item.object, 1U << l);
+		}
+	}
 
-Scene::~Scene() {
-	while (first_camera) {
-		delete_camera(first_camera);
+	//...and merge each object's masks, keeping objects with the same vao together:
+	std::sort(layered.objects.begin(), layered.objects.end(), [program_type](std::pair< Object const *, uint32_t > const &a, std::pair< Object const *, uint32_t > const &b) {
+		GLuint av = a.first->programs[program_type].vao;
+		GLuint bv = b.first->programs[program_type].vao;
+		if (av != bv) return av < bv;
+		return a.first < b.first;
+	});
+
+	for (uint32_t begin = 0; begin < layered.objects.size(); /* later */) {
+		Object const *object = layered.objects[begin].first;
+		uint32_t mask = 0;
+		uint32_t end = begin;
+		while (end < layered.objects.size() && layered.objects[end].first == object) {
+			mask |= layered.objects[end].second;
+			++end;
+		}
+		begin = end;
+
+		Object::ProgramInfo const &info = object->programs[program_type];
+		glm::mat4x3 object_to_world = glm::mat4x3(object->transform->make_local_to_world());
+		auto add_draw = [&](uint32_t layer_mask) {
+			layered.draws.emplace_back();
+			LayeredPass::Draw &draw = layered.draws.back();
+			draw.object = object;
+			draw.object_to_world = object_to_world;
+			draw.layer_mask = layer_mask;
+			draw.ranges_begin = draw.ranges_end = uint32_t(layered.ranges.size());
+		};
+
+		if (object->batch) {
+			//each cell of the batch goes only to the layers whose frustum it meets (a draw per run of cells with the same layers):
+			for (StaticBatch::Range const &range : object->batch->ranges) {
+				uint32_t range_mask = 0;
+				for (uint32_t l = 0; l < frustums.size(); ++l) {
+					if ((mask & (1U << l)) && frustums[l].intersects_box(range.min, range.max)) range_mask |= (1U << l);
+				}
+				if (range_mask == 0) continue;
+				if (layered.draws.empty() || layered.draws.back().object != object || layered.draws.back().layer_mask != range_mask) {
+					add_draw(range_mask);
+				}
+				LayeredPass::Draw &draw = layered.draws.back();
+				GLuint start = info.start + range.start;
+				if (draw.ranges_end > draw.ranges_begin && layered.ranges.back().start + layered.ranges.back().count == start) {
+					layered.ranges.back().count += range.count;
+				} else {
+					layered.ranges.emplace_back();
+					layered.ranges.back().start = start;
+					layered.ranges.back().count = range.count;
+				}
+				draw.ranges_end = uint32_t(layered.ranges.size());
+			}
+		} else {
+			add_draw(mask);
+			layered.ranges.emplace_back();
+			layered.ranges.back().start = info.start;
+			layered.ranges.back().count = info.count;
+			layered.draws.back().ranges_end = uint32_t(layered.ranges.size());
+		}
+	}
+}
+
+void Scene::submit_layered(LayeredPass const &layered, GLuint object_to_world_mat4x3, GLuint layer_mask_uint) const {
+	GLuint bound_vao = -1U; //(vao zero is a valid thing to bind)
+	Object const *bound_object = nullptr;
+	for (LayeredPass::Draw const &draw : layered.draws) {
+		GLuint vao = draw.object->programs[layered.program_type].vao;
+		if (vao != bound_vao) {
+			glBindVertexArray(vao);
+			bound_vao = vao;
+		}
+		if (draw.object != bound_object) {
+			glUniformMatrix4x3fv(object_to_world_mat4x3, 1, GL_FALSE, glm::value_ptr(draw.object_to_world));
+			bound_object = draw.object;
+		}
+		glUniform1ui(layer_mask_uint, draw.layer_mask);
+		for (uint32_t r = draw.ranges_begin; r < draw.ranges_end; ++r) {
+			glDrawArrays(GL_TRIANGLES, layered.ranges[r].start, layered.ranges[r].count);
+		}
+	}
+	glBindVertexArray(0);
+}
+
+
+void Scene::clear() {
+	//Transforms and Objects may hold heap memory (names, uniform callbacks); release it directly
+	// instead of running destructors (which would also tear down the hierarchy one link at a time):
+	for (Transform *t = first_transform; t != nullptr; t = t->alloc_next) {
+		std::string().swap(t->name);
+	}
+	for (Object *o = first_object; o != nullptr; o = o->alloc_next) {
+		for (uint32_t i = 0; i < Object::ProgramTypes; ++i) {
+			o->programs[i].set_uniforms = nullptr;
+		}
+	}
+	static_assert(std::is_trivially_destructible< Lamp >::value, "Lamps can be dropped without destruction.");
+	static_assert(std::is_trivially_destructible< Camera >::value, "Cameras can be dropped without destruction.");
+
+	render_queues_dirty = true;
+	if (spatial_index) spatial_index->clear();
+
+	first_transform = nullptr;
+	first_object = nullptr;
+	first_lamp = nullptr;
+	first_camera = nullptr;
+
+	transform_pool.reset();
+	object_pool.reset();
+	lamp_pool.reset();
+	camera_pool.reset();
+}
+
+template< typename T >
+Scene::PoolStats make_pool_stats(Pool< T > const &pool) {
+	Scene::PoolStats ret;
+	ret.live = pool.live;
+	ret.peak = pool.peak;
+	ret.bytes = pool.bytes();
+	return ret;
+}
+
+Scene::Stats Scene::get_stats() const {
+	Stats stats;
+	stats.transforms = make_pool_stats(transform_pool);
+	stats.objects = make_pool_stats(object_pool);
+	stats.lamps = make_pool_stats(lamp_pool);
+	stats.cameras = make_pool_stats(camera_pool);
+	return stats;
+}
+
+Scene::StaticBatch::~StaticBatch() {
+	for (uint32_t t = 0; t < Object::ProgramTypes; ++t) {
+		if (vaos[t] != 0) {
+			glDeleteVertexArrays(1, &vaos[t]);
+			vaos[t] = 0;
+		}
+	}
+	if (vbo != 0) {
+		glDeleteBuffers(1, &vbo);
+		vbo = 0;
+	}
+}
+
+Scene::Object *Scene::bake(std::vector< Object * > const &objects, MeshBuffer const &buffer, StaticBatch *batch, float cell_size) {
+	assert(batch && "Must have a batch to bake into.");
+	if (objects.empty()) {
+		throw std::runtime_error("Can't bake an empty set of objects.");
+	}
+	if (buffer.vertex_data.empty() || buffer.Position.size != 3 || buffer.Position.type != GL_FLOAT) {
+		throw std::runtime_error("Can't bake from a mesh buffer without float3 positions.");
+	}
+	bool has_normals = (buffer.Normal.size == 3 && buffer.Normal.type == GL_FLOAT);
+	GLsizei stride = buffer.Position.stride;
+	GLuint total = GLuint(buffer.vertex_data.size() / stride);
+
+	Object const &first = *objects[0];
+	for (Object const *object : objects) {
+		for (uint32_t t = 0; t < Object::ProgramTypes; ++t) {
+			Object::ProgramInfo const &info = object->programs[t];
+			if (DrawState(info) != DrawState(first.programs[t]) || info.set_uniforms) {
+				throw std::runtime_error("Baked objects must share program info and not set uniforms.");
+			}
+			if (info.program != 0 && info.start + info.count > total) {
+				throw std::runtime_error("Baked object refers to vertices outside of its mesh buffer.");
+			}
+		}
 	}
-	while (first_object) {
-		delete_object(first_object);
+
+	//the vertices drawn by each object (taken from the first program type that has any):
+	auto vertex_range = [](Object const *object, GLuint *start, GLuint *count) {
+		for (uint32_t t = 0; t < Object::ProgramTypes; ++t) {
+			if (object->programs[t].program != 0) {
+				*start = object->programs[t].start;
+				*count = object->programs[t].count;
+				return;
+			}
+		}
+		*start = *count = 0;
+	};
+
+	//sort objects by cell:
+	struct Entry {
+		Object const *object;
+		glm::ivec3 cell;
+	};
+	std::vector< Entry > entries;
+	entries.reserve(objects.size());
+	for (Object const *object : objects) {
+		glm::vec3 min, max;
+		if (!object->make_world_bounds(&min, &max)) {
+			min = max = glm::vec3(object->transform->make_local_to_world()[3]);
+		}
+		glm::vec3 center = 0.5f * (min + max);
+		entries.emplace_back();
+		entries.back().object = object;
+		entries.back().cell = glm::ivec3(0);
+		if (cell_size > 0.0f) {
+			entries.back().cell = glm::ivec3(glm::floor(center / cell_size));
+		}
 	}
-	while (first_transform) {
-		delete_transform(first_transform);
+	std::stable_sort(entries.begin(), entries.end(), [](Entry const &a, Entry const &b) {
+		if (a.cell.z != b.cell.z) return a.cell.z < b.cell.z;
+		if (a.cell.y != b.cell.y) return a.cell.y < b.cell.y;
+		return a.cell.x < b.cell.x;
+	});
+
+	//transform vertices into the staging area, one range per cell:
+	batch->vertex_data.clear();
+	batch->ranges.clear();
+	GLuint written = 0;
+	for (uint32_t i = 0; i < entries.size(); ++i) {
+		if (i == 0 || entries[i].cell != entries[i-1].cell) {
+			batch->ranges.emplace_back();
+			batch->ranges.back().start = written;
+		}
+		StaticBatch::Range &range = batch->ranges.back();
+
+		Transform const *transform = entries[i].object->transform;
+		glm::mat4 const &local_to_world = transform->make_local_to_world();
+		glm::mat3 const &normal_to_world = transform->make_normal_to_world();
+
+		GLuint start, count;
+		vertex_range(entries[i].object, &start, &count);
+		char const *src = buffer.vertex_data.data() + size_t(start) * stride;
+		batch->vertex_data.insert(batch->vertex_data.end(), src, src + size_t(count) * stride);
+		char *dst = batch->vertex_data.data() + size_t(written) * stride;
+		for (GLuint v = 0; v < count; ++v, dst += stride) {
+			glm::vec3 position;
+			std::memcpy(&position, dst + buffer.Position.offset, sizeof(position));
+			position = glm::vec3(local_to_world * glm::vec4(position, 1.0f));
+			std::memcpy(dst + buffer.Position.offset, &position, sizeof(position));
+			if (has_normals) {
+				glm::vec3 normal;
+				std::memcpy(&normal, dst + buffer.Normal.offset, sizeof(normal));
+				normal = normal_to_world * normal;
+				std::memcpy(dst + buffer.Normal.offset, &normal, sizeof(normal));
+			}
+			if (range.count == 0 && v == 0) {
+				range.min = range.max = position;
+			} else {
+				range.min = glm::min(range.min, position);
+				range.max = glm::max(range.max, position);
+			}
+		}
+		range.count += count;
+		written += count;
+	}
+
+	Object *baked = new_batch_object(batch, buffer, first.programs);
+
+	for (Object *object : objects) {
+		delete_object(object);
+	}
+
+	return baked;
+}
+
+Scene::Object *Scene::new_batch_object(StaticBatch *batch, MeshBuffer const &layout, Object::ProgramInfo const (&programs)[Object::ProgramTypes]) {
+	assert(batch && "Must have a batch to draw.");
+	GLuint total = 0;
+	for (StaticBatch::Range const &range : batch->ranges) {
+		total = std::max(total, range.start + range.count);
+	}
+	assert(size_t(total) * layout.Position.stride <= batch->vertex_data.size() && "Batch ranges must lie within its vertex data.");
+
+	//upload, reusing the batch's buffer:
+	if (batch->vbo == 0) glGenBuffers(1, &batch->vbo);
+	glBindBuffer(GL_ARRAY_BUFFER, batch->vbo);
+	glBufferData(GL_ARRAY_BUFFER, batch->vertex_data.size(), batch->vertex_data.data(), GL_STATIC_DRAW);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+	//(re-)make vertex arrays only if the program or the vertex layout changed:
+	for (uint32_t t = 0; t < Object::ProgramTypes; ++t) {
+		GLuint program = programs[t].program;
+		if (batch->vaos[t] != 0 && batch->programs[t] == program && batch->source == &layout) continue;
+		if (batch->vaos[t] != 0) {
+			glDeleteVertexArrays(1, &batch->vaos[t]);
+			batch->vaos[t] = 0;
+		}
+		batch->programs[t] = program;
+		if (program != 0) batch->vaos[t] = layout.make_vao_for_buffer(batch->vbo, program);
+		render_queues_dirty = true; //(the new vao may reuse a deleted one's name, so queued states can't be trusted)
+	}
+	batch->source = &layout;
+
+	++static_version;
+
+	Object *object = new_object(new_transform());
+	for (uint32_t t = 0; t < Object::ProgramTypes; ++t) {
+		Object::ProgramInfo info = programs[t];
+		info.vao = batch->vaos[t];
+		info.start = 0;
+		info.count = total;
+		info.instanced_program = 0;
+		info.instanced_vao = 0;
+		set_program(object, Object::ProgramType(t), info);
+	}
+	object->batch = batch;
+	if (!batch->ranges.empty()) {
+		glm::vec3 min = batch->ranges[0].min;
+		glm::vec3 max = batch->ranges[0].max;
+		for (StaticBatch::Range const &range : batch->ranges) {
+			min = glm::min(min, range.min);
+			max = glm::max(max, range.max);
+		}
+		object->set_bounds(min, max);
+	}
+	return object;
+}
+
+Scene::Scene() {
+}
+
+Scene::~Scene() {
+	clear();
+	if (instance_buffer != 0) {
+		glDeleteBuffers(1, &instance_buffer);
+		instance_buffer = 0;
 	}
 }
 
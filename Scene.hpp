@@ -1,6 +1,8 @@
 #pragma once
 
 #include "GL.hpp"
+#include "Pool.hpp"
+#include "ThreadPool.hpp"
 
 #include <glm/glm.hpp>
 #include <glm/gtc/quaternion.hpp>
@@ -9,10 +11,16 @@
 #include <list>
 #include <functional>
 #include <string>
+#include <memory>
+
+struct MeshBuffer;
+struct SpatialIndex;
 
 //"Scene" manages a hierarchy of transformations with, potentially, attached information.
 struct Scene {
 
+	struct StaticBatch;
+
 	struct Transform {
 		//useful to know sometimes:
 		std::string name;
@@ -38,8 +46,16 @@ struct Scene {
 		//computed from the above:
 		glm::mat4 make_local_to_parent() const;
 		glm::mat4 make_parent_to_local() const;
-		glm::mat4 make_local_to_world() const;
-		glm::mat4 make_world_to_local() const;
+
+		//cached; recomputed lazily when position, rotation, scale, or parent change:
+		glm::mat4 const &make_local_to_world() const;
+		glm::mat4 const &make_world_to_local() const;
+		//inverse-transpose of the upper 3x3 of local_to_world (for transforming normals):
+		glm::mat3 const &make_normal_to_world() const;
+
+		//mark the cached matrices of this transform and its descendants as stale:
+		// (set_parent calls this; changes to position/rotation/scale are noticed automatically)
+		void invalidate() const;
 
 		//constructor/destructor:
 		Transform() = default;
@@ -56,6 +72,22 @@ struct Scene {
 		//used by Scene to manage allocation:
 		Transform **alloc_prev_next = nullptr;
 		Transform *alloc_next = nullptr;
+
+		//used by make_*_to_world to cache world matrices:
+		struct Cache {
+			bool dirty = true; //set by invalidate(), cleared by update_cache()
+			//position/rotation/scale as of the last update; compared to catch direct edits:
+			glm::vec3 position = glm::vec3(0.0f);
+			glm::quat rotation = glm::quat(1.0f, 0.0f, 0.0f, 0.0f);
+			glm::vec3 scale = glm::vec3(1.0f);
+			//scale factor of local_to_world if it is uniform, otherwise 0:
+			float uniform_scale = 1.0f;
+			glm::mat4 local_to_world = glm::mat4(1.0f);
+			glm::mat4 world_to_local = glm::mat4(1.0f);
+			glm::mat3 normal_to_world = glm::mat3(1.0f);
+		};
+		mutable Cache cache;
+		void update_cache() const;
 	};
 
 	//"Object"s contain information needed to render meshes:
@@ -69,6 +101,7 @@ struct Scene {
 		enum ProgramType : uint32_t {
 			ProgramTypeDefault = 0,
 			ProgramTypeShadow = 1,
+			ProgramTypeGBuffer = 2, //writes surface attributes for deferred lighting
 			ProgramTypes //count of program types
 		};
 		struct ProgramInfo {
@@ -88,7 +121,33 @@ struct Scene {
 			//textures:
 			enum : uint32_t { TextureCount = 4 };
 			GLuint textures[TextureCount] = {0,0,0,0}; //textures to bind
-		} programs[ProgramTypes];
+
+			//(optional) instanced variant of 'program':
+			// objects with identical program info (and no set_uniforms) are drawn with one glDrawArraysInstanced,
+			// and the matrices above are passed per-instance as vertex attributes (see Scene::Instance).
+			GLuint instanced_program = 0;
+			GLuint instanced_vao = 0; //same mesh data as 'vao', with per-instance attributes left unbound
+		} programs[ProgramTypes]; //(set with Scene::set_program, so the scene knows to re-sort its render queues)
+
+		//bounding box in object space (e.g., from MeshBuffer::Mesh), used for culling:
+		// (objects without bounds are never culled)
+		bool has_bounds = false;
+		glm::vec3 bounds_min = glm::vec3(0.0f);
+		glm::vec3 bounds_max = glm::vec3(0.0f);
+		void set_bounds(glm::vec3 const &min, glm::vec3 const &max) {
+			has_bounds = true;
+			bounds_min = min;
+			bounds_max = max;
+		}
+		//world-space bounding box of the object, derived from bounds and transform:
+		// (returns false if the object has no bounds)
+		bool make_world_bounds(glm::vec3 *min, glm::vec3 *max) const;
+
+		//(optional) baked static geometry drawn by this object; draw() culls the batch's ranges individually:
+		StaticBatch const *batch = nullptr;
+
+		//used by Scene to find the object in its render queues:
+		mutable uint32_t queue_positions[ProgramTypes] = {0,0,0};
 
 		//used by Scene to manage allocation:
 		Object **alloc_prev_next = nullptr;
@@ -149,7 +208,8 @@ struct Scene {
 	};
 
 	//------ functions to create / destroy scene things -----
-	//NOTE: all scene objects are automatically freed when scene is deallocated
+	//NOTE: all scene objects are automatically freed when scene is deallocated or cleared
+	//NOTE: scene things are allocated from per-type pools, so pointers remain valid until deleted
 
 	//Create a new transform:
 	Transform *new_transform();
@@ -160,6 +220,8 @@ struct Scene {
 	Object *new_object(Transform *transform);
 	//Delete an object:
 	void delete_object(Object *);
+	//Set (or change) the program info an object uses for one program type:
+	void set_program(Object *object, Object::ProgramType type, Object::ProgramInfo const &info);
 
 	//Create a new lamp attached to a transform:
 	Lamp *new_lamp(Transform *transform);
@@ -171,6 +233,10 @@ struct Scene {
 	//Delete a camera:
 	void delete_camera(Camera *);
 
+	//Delete all transforms, objects, lamps, and cameras at once:
+	// (pool memory is kept for reuse, so re-filling the scene doesn't allocate)
+	void clear();
+
 	//used to manage allocated objects:
 	Transform *first_transform = nullptr;
 	Object *first_object = nullptr;
@@ -178,8 +244,79 @@ struct Scene {
 	Camera *first_camera = nullptr;
 	//(you shouldn't be manipulating these pointers directly
 
+	//storage for the above:
+	Pool< Transform > transform_pool;
+	Pool< Object > object_pool;
+	Pool< Lamp > lamp_pool;
+	Pool< Camera > camera_pool;
+
+	//memory use counters (e.g., to check that nothing grows across scene reloads):
+	struct PoolStats {
+		size_t live = 0; //things currently allocated
+		size_t peak = 0; //most things ever allocated at once
+		size_t bytes = 0; //bytes reserved for things of this type
+	};
+	struct Stats {
+		PoolStats transforms, objects, lamps, cameras;
+		size_t total_bytes() const { return transforms.bytes + objects.bytes + lamps.bytes + cameras.bytes; }
+	};
+	Stats get_stats() const;
+
+	//------ static geometry ------
+
+	//"StaticBatch" holds the vertices of objects that never move, pre-transformed to world space:
+	// (the batch's GL buffer and vertex arrays survive re-baking, which only re-uploads vertex data)
+	struct StaticBatch {
+		GLuint vbo = 0; //world-space vertices, laid out like the source MeshBuffer
+
+		//vertex arrays for vbo, per program type (remade only when the program or source buffer changes):
+		MeshBuffer const *source = nullptr;
+		GLuint programs[Object::ProgramTypes] = {0,0,0};
+		GLuint vaos[Object::ProgramTypes] = {0,0,0};
+
+		//vertices are grouped into grid cells, each a contiguous range with world-space bounds (for culling):
+		struct Range {
+			GLuint start = 0;
+			GLuint count = 0;
+			glm::vec3 min = glm::vec3(0.0f);
+			glm::vec3 max = glm::vec3(0.0f);
+		};
+		std::vector< Range > ranges;
+
+		std::vector< char > vertex_data; //staging area for vbo
+
+		StaticBatch() = default;
+		StaticBatch(StaticBatch const &) = delete;
+		~StaticBatch();
+	};
+
+	//Replace 'objects' by a single object that draws them from 'batch':
+	// - the objects must share program info (except start/count) and must not use set_uniforms
+	// - 'buffer' must be the mesh buffer that the objects' vaos and start/count refer to
+	// - vertices are grouped by the grid cell (of size 'cell_size') containing each object's bounds center
+	// - the objects are deleted (their transforms are left alone); the new object has its own identity transform
+	// will throw if the objects can't be baked together
+	Object *bake(std::vector< Object * > const &objects, MeshBuffer const &buffer, StaticBatch *batch, float cell_size);
+
+	//Upload batch->vertex_data (laid out like 'layout') and make an object that draws batch->ranges with 'programs':
+	// (vao, start, and count are filled in from the batch; used by bake() and by code that generates batches directly)
+	Object *new_batch_object(StaticBatch *batch, MeshBuffer const &layout, Object::ProgramInfo const (&programs)[Object::ProgramTypes]);
+
+	//incremented whenever static geometry changes (a batch object is made or deleted), so views of it can be cached:
+	uint32_t static_version = 0;
+
 	//------ functions to traverse the scene ------
 
+	//"Frustum" holds the six clip planes of a world-to-clip matrix for culling:
+	struct Frustum {
+		Frustum(glm::mat4 const &world_to_clip);
+		//planes are (normal, offset) with dot(normal, p) + offset >= 0 for points p inside:
+		glm::vec4 planes[6];
+		//conservative tests (may report some outside volumes as intersecting near corners):
+		bool intersects_box(glm::vec3 const &min, glm::vec3 const &max) const;
+		bool intersects_sphere(glm::vec3 const &center, float radius) const;
+	};
+
 	//Draw the scene from a given camera by computing appropriate matrices and sending all objects to OpenGL:
 	//"camera" must be non-null!
 	void draw(Camera const *camera, Object::ProgramType = Object::ProgramTypeDefault ) const;
@@ -189,11 +326,158 @@ struct Scene {
 	void draw(Lamp const *lamp, Object::ProgramType = Object::ProgramTypeDefault ) const;
 
 	//More general draw function. Will render with a specified projection transformation and use programs in the given slot of all objects:
+	// (objects are drawn grouped by program/vao/textures and front-to-back within each group)
+	// (objects with bounds outside the frustum of world_to_clip are skipped)
+	// (same as preparing and submitting a single Pass; see below)
 	void draw(
 		glm::mat4 const &world_to_clip,
 		Object::ProgramType program_type) const;
 
-	~Scene(); //destructor deallocates transforms, objects, cameras
+	//------ render queue ------
+	//draw() keeps, per program type, a list of objects sorted by the GL state they need.
+	// The list is rebuilt (at the next draw or prepare) after objects are added or removed, set_program(), or new_batch_object().
+	// (code that edits Object::programs directly must call invalidate_render_queues() itself)
+
+	//the parts of ProgramInfo that cost a GL call to change:
+	struct DrawState {
+		GLuint program = 0;
+		GLuint vao = 0;
+		GLuint textures[Object::ProgramInfo::TextureCount] = {0,0,0,0};
+		GLuint instanced_program = 0;
+		GLuint instanced_vao = 0;
+		DrawState() = default;
+		DrawState(Object::ProgramInfo const &info);
+		bool operator==(DrawState const &other) const;
+		bool operator!=(DrawState const &other) const { return !(*this == other); }
+		bool operator<(DrawState const &other) const;
+	};
+	struct DrawItem {
+		Object const *object = nullptr;
+		DrawState state; //state of object->programs[type] when the queue was built
+		float depth = 0.0f; //clip-space w of the object's origin in a pass
+		bool visible = true; //bounds intersect the frustum of a pass
+	};
+	mutable std::vector< DrawItem > render_queues[Object::ProgramTypes];
+	mutable bool render_queues_dirty = true;
+	void invalidate_render_queues() { render_queues_dirty = true; }
+	mutable uint32_t render_queue_drawable[Object::ProgramTypes] = {0,0,0}; //queued objects that have a program of each type
+	//rebuild (if needed) the queues for all program types:
+	void update_render_queues() const;
+	//...and return the one for a given program type:
+	std::vector< DrawItem > &update_render_queue(Object::ProgramType program_type) const;
+
+	//------ instancing ------
+	//per-instance data streamed to ProgramInfo::instanced_program:
+	struct Instance {
+		glm::mat4 object_to_clip;
+		glm::mat4x3 object_to_light;
+		glm::mat3 normal_to_light;
+	};
+	static_assert(sizeof(Instance) == 4*16 + 4*12 + 4*9, "Instance is packed.");
+	//attribute locations instanced programs must use for Instance members:
+	enum : GLuint {
+		InstanceObjectToClipLocation = 4, //mat4 -- locations 4-7
+		InstanceObjectToLightLocation = 8, //mat4x3 -- locations 8-11
+		InstanceNormalToLightLocation = 12, //mat3 -- locations 12-14
+	};
+	mutable GLuint instance_buffer = 0; //holds instance data for all passes of the last prepare()
+
+	//------ passes ------
+	//Drawing is split into preparation (culling, sorting, and matrix math -- no GL calls) and submission (only GL calls),
+	// so that all the passes of a frame can be prepared at once, in parallel.
+
+	//"Pass" is one view of the scene:
+	struct Pass {
+		glm::mat4 world_to_clip = glm::mat4(1.0f);
+		Object::ProgramType program_type = Object::ProgramTypeDefault;
+		Object const *exclude = nullptr; //(optional) object to leave out of this pass (e.g., the body holding a lamp)
+		//(optional) draw only static objects (those drawing a StaticBatch) or only the others:
+		enum Filter : uint32_t {
+			AllObjects,
+			StaticObjects,
+			DynamicObjects
+		} filter = AllObjects;
+
+		//computed by prepare():
+		struct Range {
+			GLuint start, count;
+		};
+		struct Draw { //one object drawn without instancing
+			Object const *object;
+			glm::mat4 mvp; //object space to clip space
+			glm::mat4x3 mv; //object space to lighting (world) space
+			glm::mat3 itmv; //inverse-transpose of mv, for normals
+			uint32_t ranges_begin, ranges_end; //vertex ranges to draw, in 'ranges'
+		};
+		struct Batch { //run of objects sharing GL state
+			Object::ProgramInfo const *info; //program info of the first object in the run
+			uint32_t first_instance; //offset in 'instances', or -1U if not instanced
+			uint32_t instance_count;
+			uint32_t draws_begin, draws_end; //non-instanced draws, in 'draws'
+		};
+		std::vector< DrawItem > items; //copy of the render queue with per-pass visibility and depth
+		std::vector< Object const * > found; //objects found by the spatial index (if enabled)
+		std::vector< uint32_t > found_positions; //...and their positions in the render queue
+		std::vector< Batch > batches;
+		std::vector< Draw > draws;
+		std::vector< Range > ranges;
+		std::vector< Instance > instances;
+		GLuint instance_base = 0; //offset of 'instances' in instance_buffer
+		//objects with a program of this type that were drawn, and that were culled (or excluded):
+		uint32_t objects_drawn = 0;
+		uint32_t objects_culled = 0;
+	};
+
+	//Compute visibility, order, and matrices for every pass (on worker threads, unless single_threaded_prepare is set):
+	// note: passes must be submitted before the next prepare() or draw(), since instance data is replaced
+	void prepare(std::vector< Pass > *passes) const;
+	//Issue the GL calls for a prepared pass:
+	void submit(Pass const &pass) const;
+
+	bool single_threaded_prepare = false; //(results are identical either way; useful for comparison)
+
+	//"LayeredPass" draws several prepared passes of one program type (e.g., the shadow maps of several lights) with one submission:
+	// each object visible in any of them is drawn once, with a mask of the layers (passes) it is visible in, by a program whose
+	// geometry shader sends each triangle on to just those layers (e.g., LayeredDepthProgram).
+	// Masks are per object, and per cell of static batches (so each part of a batch only goes to the layers whose frustum it meets).
+	struct LayeredPass {
+		std::vector< Pass const * > layers; //prepared passes, in layer order (at most 32)
+
+		//computed by prepare_layered():
+		Object::ProgramType program_type = Object::ProgramTypeDefault; //(that of the layers; objects are drawn with that type's vao)
+		struct Draw {
+			Object const *object;
+			glm::mat4x3 object_to_world;
+			uint32_t layer_mask; //bit i set to draw into layers[i]
+			uint32_t ranges_begin, ranges_end; //vertex ranges to draw, in 'ranges'
+		};
+		std::vector< Draw > draws; //(grouped by vao)
+		std::vector< Pass::Range > ranges;
+		std::vector< std::pair< Object const *, uint32_t > > objects; //(scratch space: objects and the layers they are visible in)
+	};
+	//Find what to draw for the layers (which must have been prepared):
+	void prepare_layered(LayeredPass *layered) const;
+	//Issue the GL calls for a prepared LayeredPass, with its program already bound:
+	// (only vertex arrays and the given uniforms are set; ProgramInfo textures and set_uniforms are not used)
+	void submit_layered(LayeredPass const &layered, GLuint object_to_world_mat4x3, GLuint layer_mask_uint) const;
+
+	//------ spatial index ------
+	//With an index set, prepare() keeps it up to date with objects' world bounds,
+	// and passes gather visible objects by querying it instead of testing every object.
+	// e.g., scene.spatial_index.reset(new SpatialIndex(SpatialIndex::Grid, 2.0f));
+	// (use SpatialIndex::Grid for flat worlds, SpatialIndex::BVH for anything else)
+	std::unique_ptr< SpatialIndex > spatial_index;
+	//bring the index up to date (called by prepare(); call it yourself before querying at other times):
+	void update_spatial_index() const;
+
+	//internals:
+	void prepare_pass(Pass *pass) const; //the per-pass part of prepare(); only reads the scene
+	mutable ThreadPool prepare_pool;
+	mutable std::vector< Pass > draw_passes; //used by draw()
+
+	Scene(); //(defined alongside the destructor, where SpatialIndex is complete)
+	Scene(Scene const &) = delete;
+	~Scene(); //destructor deallocates transforms, objects, lamps, cameras
 
 	//add transforms/objects/cameras from a scene file:
 	// the 'on_object' callback gives you a chance to look up a mesh by name and make an object.
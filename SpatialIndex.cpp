@@ -0,0 +1,467 @@
+#include "SpatialIndex.hpp"
+
+#include <algorithm>
+#include <limits>
+#include <cmath>
+#include <cassert>
+
+//helpers for box tests:
+static bool boxes_overlap(glm::vec3 const &a_min, glm::vec3 const &a_max, glm::vec3 const &b_min, glm::vec3 const &b_max) {
+	return a_min.x <= b_max.x && b_min.x <= a_max.x
+	    && a_min.y <= b_max.y && b_min.y <= a_max.y
+	    && a_min.z <= b_max.z && b_min.z <= a_max.z;
+}
+
+static bool box_touches_sphere(glm::vec3 const &min, glm::vec3 const &max, glm::vec3 const &center, float radius) {
+	glm::vec3 closest = glm::clamp(center, min, max);
+	glm::vec3 dif = closest - center;
+	return glm::dot(dif, dif) <= radius * radius;
+}
+
+//slab test; on hit, *t_enter is where the ray enters the box (clamped to zero):
+static bool ray_hits_box(glm::vec3 const &origin, glm::vec3 const &inv_direction, float max_t, glm::vec3 const &min, glm::vec3 const &max, float *t_enter) {
+	float t0 = 0.0f;
+	float t1 = max_t;
+	for (uint32_t a = 0; a < 3; ++a) {
+		float near = (min[a] - origin[a]) * inv_direction[a];
+		float far = (max[a] - origin[a]) * inv_direction[a];
+		if (near > far) std::swap(near, far);
+		//(NaN from 0 * inf -- ray in the plane of a slab face -- leaves the interval alone)
+		if (near > t0) t0 = near;
+		if (far < t1) t1 = far;
+		if (t0 > t1) return false;
+	}
+	*t_enter = t0;
+	return true;
+}
+
+SpatialIndex::SpatialIndex(Type type_, float cell_size_) : type(type_), cell_size(cell_size_) {
+	assert(cell_size > 0.0f);
+}
+
+//---------------------------
+
+void SpatialIndex::update(Scene::Object const *object, bool bounded, glm::vec3 const &min, glm::vec3 const &max) {
+	assert(object);
+	uint32_t index;
+	auto f = lookup.find(object);
+	bool existing = (f != lookup.end());
+	if (!existing) {
+		if (!free_entries.empty()) {
+			index = free_entries.back();
+			free_entries.pop_back();
+		} else {
+			index = uint32_t(entries.size());
+			entries.emplace_back();
+		}
+		lookup.insert(std::make_pair(object, index));
+		entries[index] = Entry();
+		entries[index].object = object;
+		structure_dirty = true;
+	} else {
+		index = f->second;
+		Entry const &entry = entries[index];
+		if (entry.bounded == bounded && (!bounded || (entry.min == min && entry.max == max))) return; //didn't move
+		//take the entry out of its old place:
+		if (!entry.bounded) {
+			unbounded.erase(std::find(unbounded.begin(), unbounded.end(), index));
+			structure_dirty = true;
+		} else if (type == Grid) {
+			grid_erase(index);
+		} else if (!bounded) {
+			structure_dirty = true;
+		}
+	}
+
+	Entry &entry = entries[index];
+	bool was_bounded = existing && entry.bounded;
+	entry.bounded = bounded;
+	entry.min = min;
+	entry.max = max;
+
+	if (!bounded) {
+		unbounded.emplace_back(index);
+	} else if (type == Grid) {
+		grid_insert(index);
+	} else if (was_bounded && !structure_dirty) {
+		//moved within the hierarchy; loosen ancestors to fit:
+		refit(entry.leaf);
+		++refits;
+	} else {
+		structure_dirty = true;
+	}
+}
+
+void SpatialIndex::remove(Scene::Object const *object) {
+	auto f = lookup.find(object);
+	if (f == lookup.end()) return;
+	uint32_t index = f->second;
+	lookup.erase(f);
+
+	Entry &entry = entries[index];
+	if (!entry.bounded) {
+		unbounded.erase(std::find(unbounded.begin(), unbounded.end(), index));
+	} else if (type == Grid) {
+		grid_erase(index);
+	}
+	entry = Entry();
+	free_entries.emplace_back(index);
+	structure_dirty = true;
+}
+
+void SpatialIndex::clear() {
+	entries.clear();
+	free_entries.clear();
+	lookup.clear();
+	unbounded.clear();
+	for (auto &cell : cells) {
+		cell.second.clear(); //(keep the cells' memory for reuse)
+	}
+	large.clear();
+	occupied_min = glm::ivec2(0);
+	occupied_max = glm::ivec2(-1);
+	nodes.clear();
+	leaf_entries.clear();
+	structure_dirty = false;
+	refits = 0;
+}
+
+void SpatialIndex::refresh() {
+	if (type != BVH) return;
+	//rebuild if entries were added or removed, or once as many moves as there are entries have been refit:
+	if (!structure_dirty && refits <= lookup.size()) return;
+
+	nodes.clear();
+	leaf_entries.clear();
+	for (uint32_t i = 0; i < entries.size(); ++i) {
+		if (entries[i].object && entries[i].bounded) leaf_entries.emplace_back(i);
+	}
+	if (!leaf_entries.empty()) {
+		build_node(-1U, 0, uint32_t(leaf_entries.size()));
+	}
+	structure_dirty = false;
+	refits = 0;
+}
+
+//---------------------------
+//Grid:
+
+glm::ivec2 SpatialIndex::cell_of(glm::vec3 const &point) const {
+	return glm::ivec2(int32_t(std::floor(point.x / cell_size)), int32_t(std::floor(point.y / cell_size)));
+}
+
+uint64_t SpatialIndex::cell_key(int32_t x, int32_t y) {
+	return (uint64_t(uint32_t(x)) << 32) | uint64_t(uint32_t(y));
+}
+
+void SpatialIndex::grid_insert(uint32_t index) {
+	Entry &entry = entries[index];
+	glm::vec3 span = (entry.max - entry.min) / cell_size;
+	entry.large = !(span.x < float(LargeCells) && span.y < float(LargeCells) && (span.x + 1.0f) * (span.y + 1.0f) < float(LargeCells));
+	if (entry.large) {
+		large.emplace_back(index);
+		return;
+	}
+	entry.cell_min = cell_of(entry.min);
+	entry.cell_max = cell_of(entry.max);
+	for (int32_t y = entry.cell_min.y; y <= entry.cell_max.y; ++y) {
+		for (int32_t x = entry.cell_min.x; x <= entry.cell_max.x; ++x) {
+			cells[cell_key(x, y)].emplace_back(index);
+		}
+	}
+	if (occupied_max.x < occupied_min.x) {
+		occupied_min = entry.cell_min;
+		occupied_max = entry.cell_max;
+		occupied_z_min = entry.min.z;
+		occupied_z_max = entry.max.z;
+	} else {
+		occupied_min = glm::min(occupied_min, entry.cell_min);
+		occupied_max = glm::max(occupied_max, entry.cell_max);
+		occupied_z_min = std::min(occupied_z_min, entry.min.z);
+		occupied_z_max = std::max(occupied_z_max, entry.max.z);
+	}
+}
+
+void SpatialIndex::grid_erase(uint32_t index) {
+	Entry const &entry = entries[index];
+	if (entry.large) {
+		large.erase(std::find(large.begin(), large.end(), index));
+		return;
+	}
+	for (int32_t y = entry.cell_min.y; y <= entry.cell_max.y; ++y) {
+		for (int32_t x = entry.cell_min.x; x <= entry.cell_max.x; ++x) {
+			std::vector< uint32_t > &cell = cells[cell_key(x, y)];
+			auto f = std::find(cell.begin(), cell.end(), index);
+			assert(f != cell.end());
+			*f = cell.back();
+			cell.pop_back();
+		}
+	}
+}
+
+//---------------------------
+//BVH:
+
+uint32_t SpatialIndex::build_node(uint32_t parent, uint32_t begin, uint32_t end) {
+	assert(begin < end);
+	uint32_t index = uint32_t(nodes.size());
+	nodes.emplace_back();
+	nodes[index].parent = parent;
+
+	glm::vec3 min = entries[leaf_entries[begin]].min;
+	glm::vec3 max = entries[leaf_entries[begin]].max;
+	glm::vec3 center_min = 0.5f * (min + max);
+	glm::vec3 center_max = center_min;
+	for (uint32_t i = begin; i < end; ++i) {
+		Entry const &entry = entries[leaf_entries[i]];
+		min = glm::min(min, entry.min);
+		max = glm::max(max, entry.max);
+		glm::vec3 center = 0.5f * (entry.min + entry.max);
+		center_min = glm::min(center_min, center);
+		center_max = glm::max(center_max, center);
+	}
+	nodes[index].min = min;
+	nodes[index].max = max;
+
+	//small enough (or all centers coincide) -- make a leaf:
+	const uint32_t LeafSize = 4;
+	glm::vec3 spread = center_max - center_min;
+	if (end - begin <= LeafSize || (spread.x == 0.0f && spread.y == 0.0f && spread.z == 0.0f)) {
+		nodes[index].begin = begin;
+		nodes[index].end = end;
+		for (uint32_t i = begin; i < end; ++i) {
+			entries[leaf_entries[i]].leaf = index;
+		}
+		return index;
+	}
+
+	//split at the median center along the axis where centers are most spread out:
+	uint32_t axis = 0;
+	if (spread.y > spread[axis]) axis = 1;
+	if (spread.z > spread[axis]) axis = 2;
+	uint32_t mid = (begin + end) / 2;
+	std::nth_element(leaf_entries.begin() + begin, leaf_entries.begin() + mid, leaf_entries.begin() + end,
+		[this,axis](uint32_t a, uint32_t b) {
+			return entries[a].min[axis] + entries[a].max[axis] < entries[b].min[axis] + entries[b].max[axis];
+		});
+
+	uint32_t left = build_node(index, begin, mid);
+	uint32_t right = build_node(index, mid, end);
+	nodes[index].left = left;
+	nodes[index].right = right;
+	return index;
+}
+
+void SpatialIndex::refit(uint32_t node) {
+	while (node != -1U) {
+		Node &n = nodes[node];
+		if (n.left == -1U) {
+			n.min = entries[leaf_entries[n.begin]].min;
+			n.max = entries[leaf_entries[n.begin]].max;
+			for (uint32_t i = n.begin; i < n.end; ++i) {
+				n.min = glm::min(n.min, entries[leaf_entries[i]].min);
+				n.max = glm::max(n.max, entries[leaf_entries[i]].max);
+			}
+		} else {
+			n.min = glm::min(nodes[n.left].min, nodes[n.right].min);
+			n.max = glm::max(nodes[n.left].max, nodes[n.right].max);
+		}
+		node = n.parent;
+	}
+}
+
+//---------------------------
+//Queries:
+
+void SpatialIndex::query_box(glm::vec3 const &min, glm::vec3 const &max, std::vector< Scene::Object const * > *out) const {
+	assert(out);
+	assert(type == Grid || !structure_dirty);
+	for (uint32_t i : unbounded) {
+		out->emplace_back(entries[i].object);
+	}
+
+	if (type == Grid) {
+		for (uint32_t i : large) {
+			if (boxes_overlap(min, max, entries[i].min, entries[i].max)) out->emplace_back(entries[i].object);
+		}
+		glm::ivec2 lo = glm::max(cell_of(min), occupied_min);
+		glm::ivec2 hi = glm::min(cell_of(max), occupied_max);
+		for (int32_t y = lo.y; y <= hi.y; ++y) {
+			for (int32_t x = lo.x; x <= hi.x; ++x) {
+				auto f = cells.find(cell_key(x, y));
+				if (f == cells.end()) continue;
+				for (uint32_t i : f->second) {
+					Entry const &entry = entries[i];
+					//entries in several cells are only reported from the first cell the query shares with them:
+					if (x != std::max(entry.cell_min.x, lo.x) || y != std::max(entry.cell_min.y, lo.y)) continue;
+					if (boxes_overlap(min, max, entry.min, entry.max)) out->emplace_back(entry.object);
+				}
+			}
+		}
+	} else if (!nodes.empty()) {
+		std::vector< uint32_t > stack(1, 0);
+		while (!stack.empty()) {
+			Node const &node = nodes[stack.back()];
+			stack.pop_back();
+			if (!boxes_overlap(min, max, node.min, node.max)) continue;
+			if (node.left != -1U) {
+				stack.emplace_back(node.left);
+				stack.emplace_back(node.right);
+				continue;
+			}
+			for (uint32_t i = node.begin; i < node.end; ++i) {
+				Entry const &entry = entries[leaf_entries[i]];
+				if (boxes_overlap(min, max, entry.min, entry.max)) out->emplace_back(entry.object);
+			}
+		}
+	}
+}
+
+void SpatialIndex::query_sphere(glm::vec3 const &center, float radius, std::vector< Scene::Object const * > *out) const {
+	assert(out);
+	//candidates from the sphere's bounding box, then exact test:
+	size_t begin = out->size();
+	query_box(center - glm::vec3(radius), center + glm::vec3(radius), out);
+	size_t keep = begin;
+	for (size_t i = begin; i < out->size(); ++i) {
+		Scene::Object const *object = (*out)[i];
+		Entry const &entry = entries[lookup.find(object)->second];
+		if (!entry.bounded || box_touches_sphere(entry.min, entry.max, center, radius)) {
+			(*out)[keep++] = object;
+		}
+	}
+	out->resize(keep);
+}
+
+void SpatialIndex::query_frustum(Scene::Frustum const &frustum, std::vector< Scene::Object const * > *out) const {
+	assert(out);
+	assert(type == Grid || !structure_dirty);
+	for (uint32_t i : unbounded) {
+		out->emplace_back(entries[i].object);
+	}
+
+	if (type == Grid) {
+		for (uint32_t i : large) {
+			if (frustum.intersects_box(entries[i].min, entries[i].max)) out->emplace_back(entries[i].object);
+		}
+		//test cells (as columns over the occupied z range), then the entries in visible cells:
+		std::vector< uint32_t > found;
+		for (int32_t y = occupied_min.y; y <= occupied_max.y; ++y) {
+			for (int32_t x = occupied_min.x; x <= occupied_max.x; ++x) {
+				auto f = cells.find(cell_key(x, y));
+				if (f == cells.end() || f->second.empty()) continue;
+				glm::vec3 cell_min(x * cell_size, y * cell_size, occupied_z_min);
+				glm::vec3 cell_max((x + 1) * cell_size, (y + 1) * cell_size, occupied_z_max);
+				if (!frustum.intersects_box(cell_min, cell_max)) continue;
+				for (uint32_t i : f->second) {
+					//single-cell entries can't be seen twice, so skip the duplicate check for them:
+					if (entries[i].cell_min == entries[i].cell_max) {
+						if (frustum.intersects_box(entries[i].min, entries[i].max)) out->emplace_back(entries[i].object);
+					} else {
+						found.emplace_back(i);
+					}
+				}
+			}
+		}
+		std::sort(found.begin(), found.end());
+		found.erase(std::unique(found.begin(), found.end()), found.end());
+		for (uint32_t i : found) {
+			if (frustum.intersects_box(entries[i].min, entries[i].max)) out->emplace_back(entries[i].object);
+		}
+	} else if (!nodes.empty()) {
+		std::vector< uint32_t > stack(1, 0);
+		while (!stack.empty()) {
+			Node const &node = nodes[stack.back()];
+			stack.pop_back();
+			if (!frustum.intersects_box(node.min, node.max)) continue;
+			if (node.left != -1U) {
+				stack.emplace_back(node.left);
+				stack.emplace_back(node.right);
+				continue;
+			}
+			for (uint32_t i = node.begin; i < node.end; ++i) {
+				Entry const &entry = entries[leaf_entries[i]];
+				if (frustum.intersects_box(entry.min, entry.max)) out->emplace_back(entry.object);
+			}
+		}
+	}
+}
+
+bool SpatialIndex::query_ray(glm::vec3 const &origin, glm::vec3 const &direction, float max_t, Scene::Object const **hit, float *hit_t) const {
+	assert(hit && hit_t);
+	assert(type == Grid || !structure_dirty);
+	glm::vec3 inv_direction = 1.0f / direction;
+
+	Scene::Object const *best = nullptr;
+	float best_t = max_t;
+	auto test = [&](Entry const &entry) {
+		float t;
+		if (ray_hits_box(origin, inv_direction, best_t, entry.min, entry.max, &t) && (best == nullptr || t < best_t)) {
+			best = entry.object;
+			best_t = t;
+		}
+	};
+
+	if (type == Grid) {
+		for (uint32_t i : large) {
+			test(entries[i]);
+		}
+		//walk the cells the ray passes through (in xy) in order, stopping once the best hit is closer than the next cell:
+		glm::ivec2 cell = cell_of(origin);
+		glm::ivec2 step(direction.x < 0.0f ? -1 : 1, direction.y < 0.0f ? -1 : 1);
+		glm::vec2 t_next, t_delta;
+		for (uint32_t a = 0; a < 2; ++a) {
+			if (direction[a] == 0.0f) {
+				t_next[a] = std::numeric_limits< float >::infinity();
+				t_delta[a] = std::numeric_limits< float >::infinity();
+			} else {
+				float boundary = (cell[a] + (step[a] > 0 ? 1 : 0)) * cell_size;
+				t_next[a] = (boundary - origin[a]) / direction[a];
+				t_delta[a] = cell_size / std::abs(direction[a]);
+			}
+		}
+		float t_cell = 0.0f; //where the ray enters the current cell
+		while (t_cell <= best_t) {
+			//stop once the ray has left the occupied cells for good:
+			if ((step.x > 0 ? cell.x > occupied_max.x : cell.x < occupied_min.x)
+			 || (step.y > 0 ? cell.y > occupied_max.y : cell.y < occupied_min.y)) break;
+			auto f = cells.find(cell_key(cell.x, cell.y));
+			if (f != cells.end()) {
+				for (uint32_t i : f->second) {
+					test(entries[i]);
+				}
+			}
+			if (t_next.x < t_next.y) {
+				t_cell = t_next.x;
+				t_next.x += t_delta.x;
+				cell.x += step.x;
+			} else {
+				t_cell = t_next.y;
+				t_next.y += t_delta.y;
+				cell.y += step.y;
+			}
+			if (std::isinf(t_cell)) break;
+		}
+	} else if (!nodes.empty()) {
+		std::vector< uint32_t > stack(1, 0);
+		while (!stack.empty()) {
+			Node const &node = nodes[stack.back()];
+			stack.pop_back();
+			float t;
+			if (!ray_hits_box(origin, inv_direction, best_t, node.min, node.max, &t)) continue;
+			if (node.left != -1U) {
+				stack.emplace_back(node.left);
+				stack.emplace_back(node.right);
+				continue;
+			}
+			for (uint32_t i = node.begin; i < node.end; ++i) {
+				test(entries[leaf_entries[i]]);
+			}
+		}
+	}
+
+	if (!best) return false;
+	*hit = best;
+	*hit_t = best_t;
+	return true;
+}
@@ -0,0 +1,88 @@
+#pragma once
+
+#include "Scene.hpp"
+
+#include <glm/glm.hpp>
+
+#include <vector>
+#include <unordered_map>
+#include <cstdint>
+
+//"SpatialIndex" finds scene objects by where their world-space bounding boxes are:
+// - 'Grid' buckets objects into square cells in the xy plane (suits flat worlds, like the maze)
+// - 'BVH' keeps a bounding volume hierarchy (suits arbitrary scenes, e.g., ones from Scene::load)
+// Scene keeps its index up to date as objects move, once one is assigned to Scene::spatial_index
+// (see Scene::update_spatial_index).
+// Objects without bounds are treated as infinitely large and match every query.
+struct SpatialIndex {
+	enum Type {
+		Grid,
+		BVH
+	};
+	SpatialIndex(Type type, float cell_size = 2.0f);
+	SpatialIndex(SpatialIndex const &) = delete;
+
+	Type type;
+	float cell_size; //(Grid only) size of cells in world units
+
+	//------ maintenance ------
+	//add an object or change its bounds (pass bounded = false for objects without bounds):
+	void update(Scene::Object const *object, bool bounded, glm::vec3 const &min, glm::vec3 const &max);
+	//forget an object:
+	void remove(Scene::Object const *object);
+	//forget all objects:
+	void clear();
+	//(BVH only) rebuild the hierarchy if objects were added or removed, or if refitting has loosened it too much:
+	// queries are only valid after refresh() has been called following any update()/remove()
+	void refresh();
+
+	//------ queries ------
+	//these append matching objects (in no particular order, each once) to 'out':
+	void query_box(glm::vec3 const &min, glm::vec3 const &max, std::vector< Scene::Object const * > *out) const;
+	void query_sphere(glm::vec3 const &center, float radius, std::vector< Scene::Object const * > *out) const;
+	void query_frustum(Scene::Frustum const &frustum, std::vector< Scene::Object const * > *out) const;
+	//find the object whose bounds are hit first by the ray origin + t * direction, t in [0, max_t]:
+	// (returns false if there is no such object; unbounded objects are never hit)
+	bool query_ray(glm::vec3 const &origin, glm::vec3 const &direction, float max_t, Scene::Object const **hit, float *hit_t) const;
+
+	//------ internals ------
+	struct Entry {
+		Scene::Object const *object = nullptr; //(nullptr for free entries)
+		glm::vec3 min = glm::vec3(0.0f);
+		glm::vec3 max = glm::vec3(0.0f);
+		bool bounded = false;
+		bool large = false; //(Grid) spans too many cells to be stored in each one
+		glm::ivec2 cell_min = glm::ivec2(0), cell_max = glm::ivec2(-1); //(Grid) cells the entry is stored in
+		uint32_t leaf = -1U; //(BVH) node holding the entry
+	};
+	std::vector< Entry > entries;
+	std::vector< uint32_t > free_entries;
+	std::unordered_map< Scene::Object const *, uint32_t > lookup; //object -> index in entries
+	std::vector< uint32_t > unbounded; //entries without bounds
+
+	//Grid:
+	std::unordered_map< uint64_t, std::vector< uint32_t > > cells;
+	std::vector< uint32_t > large; //entries spanning more than LargeCells cells
+	enum : int32_t { LargeCells = 16 };
+	glm::ivec2 occupied_min = glm::ivec2(0), occupied_max = glm::ivec2(-1); //range of cells that have ever held entries
+	float occupied_z_min = 0.0f, occupied_z_max = 0.0f; //z range of entries that have ever been in cells
+	glm::ivec2 cell_of(glm::vec3 const &point) const;
+	static uint64_t cell_key(int32_t x, int32_t y);
+	void grid_insert(uint32_t index);
+	void grid_erase(uint32_t index);
+
+	//BVH:
+	struct Node {
+		glm::vec3 min = glm::vec3(0.0f);
+		glm::vec3 max = glm::vec3(0.0f);
+		uint32_t parent = -1U;
+		uint32_t left = -1U, right = -1U; //children (-1U for leaves)
+		uint32_t begin = 0, end = 0; //(leaves) range in leaf_entries
+	};
+	std::vector< Node > nodes; //nodes[0] is the root
+	std::vector< uint32_t > leaf_entries;
+	bool structure_dirty = false; //entries added or removed since the last build
+	uint32_t refits = 0; //entries moved since the last build
+	uint32_t build_node(uint32_t parent, uint32_t begin, uint32_t end);
+	void refit(uint32_t node);
+};
@@ -0,0 +1,67 @@
+#include "ThreadPool.hpp"
+
+ThreadPool::ThreadPool(uint32_t worker_count_) : worker_count(worker_count_), next_job(0) {
+}
+
+ThreadPool::~ThreadPool() {
+	{
+		std::unique_lock< std::mutex > lock(mutex);
+		quit = true;
+	}
+	start.notify_all();
+	for (std::thread &worker : workers) {
+		worker.join();
+	}
+}
+
+void ThreadPool::run(uint32_t count, std::function< void(uint32_t) > const &job_) {
+	if (worker_count == 0 || count <= 1) {
+		for (uint32_t i = 0; i < count; ++i) {
+			job_(i);
+		}
+		return;
+	}
+
+	{
+		std::unique_lock< std::mutex > lock(mutex);
+		while (workers.size() < worker_count) {
+			workers.emplace_back(&ThreadPool::work, this);
+		}
+		job = &job_;
+		job_count = count;
+		next_job = 0;
+		busy = uint32_t(workers.size());
+		++generation;
+	}
+	start.notify_all();
+
+	//help out:
+	for (uint32_t i = next_job++; i < count; i = next_job++) {
+		job_(i);
+	}
+
+	std::unique_lock< std::mutex > lock(mutex);
+	done.wait(lock, [this](){ return busy == 0; });
+	job = nullptr;
+}
+
+void ThreadPool::work() {
+	uint32_t seen = 0; //last generation worked on
+	std::unique_lock< std::mutex > lock(mutex);
+	while (true) {
+		start.wait(lock, [this,&seen](){ return quit || generation != seen; });
+		if (quit) return;
+		seen = generation;
+		std::function< void(uint32_t) > const &current = *job;
+		uint32_t count = job_count;
+		lock.unlock();
+
+		for (uint32_t i = next_job++; i < count; i = next_job++) {
+			current(i);
+		}
+
+		lock.lock();
+		--busy;
+		if (busy == 0) done.notify_one();
+	}
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+
+//"ThreadPool" runs sets of independent jobs on a fixed set of worker threads:
+// (workers are started on first use and stopped when the pool is destroyed)
+struct ThreadPool {
+	//by default, uses one worker per hardware thread (less one for the calling thread):
+	ThreadPool(uint32_t worker_count = std::max(1U, std::thread::hardware_concurrency()) - 1);
+	ThreadPool(ThreadPool const &) = delete;
+	~ThreadPool();
+
+	//call job(i) for every i in [0,count) -- on the workers and on the calling thread -- and wait for all of the calls to finish:
+	void run(uint32_t count, std::function< void(uint32_t) > const &job);
+
+	//internals:
+	uint32_t worker_count;
+	std::vector< std::thread > workers;
+	std::mutex mutex;
+	std::condition_variable start; //signaled when a set of jobs is posted (or the pool is stopping)
+	std::condition_variable done; //signaled when the last worker finishes with a set of jobs
+	std::function< void(uint32_t) > const *job = nullptr; //current set of jobs
+	uint32_t job_count = 0;
+	std::atomic< uint32_t > next_job;
+	uint32_t generation = 0; //incremented for every set of jobs
+	uint32_t busy = 0; //workers that haven't finished with the current set
+	bool quit = false;
+	void work(); //worker thread loop
+};
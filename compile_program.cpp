@@ -31,16 +31,28 @@ GLuint compile_program(
 	std::string const &vertex_shader_source,
 	std::string const &fragment_shader_source
 	) {
+	return compile_program(vertex_shader_source, "", fragment_shader_source);
+}
+
+GLuint compile_program(
+	std::string const &vertex_shader_source,
+	std::string const &geometry_shader_source,
+	std::string const &fragment_shader_source
+	) {
 
 	GLuint vertex_shader = compile_shader(GL_VERTEX_SHADER, vertex_shader_source);
+	GLuint geometry_shader = 0;
+	if (!geometry_shader_source.empty()) geometry_shader = compile_shader(GL_GEOMETRY_SHADER, geometry_shader_source);
 	GLuint fragment_shader = compile_shader(GL_FRAGMENT_SHADER, fragment_shader_source);
 
 	GLuint program = glCreateProgram();
 	glAttachShader(program, vertex_shader);
+	if (geometry_shader) glAttachShader(program, geometry_shader);
 	glAttachShader(program, fragment_shader);
 
 	//shaders are reference counted so this makes sure they are freed after program is deleted:
 	glDeleteShader(vertex_shader);
+	if (geometry_shader) glDeleteShader(geometry_shader);
 	glDeleteShader(fragment_shader);
 
 	//link the shader program and throw errors if linking fails:
@@ -9,3 +9,9 @@
 GLuint compile_program(
 	std::string const &vertex_shader_source,
 	std::string const &fragment_shader_source);
+
+//...with a geometry shader between the two:
+GLuint compile_program(
+	std::string const &vertex_shader_source,
+	std::string const &geometry_shader_source,
+	std::string const &fragment_shader_source);
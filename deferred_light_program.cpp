@@ -0,0 +1,90 @@
+#include "deferred_light_program.hpp"
+
+#include "compile_program.hpp"
+#include "gl_errors.hpp"
+#include "texture_program.hpp"
+#include "uniform_blocks.hpp"
+
+#include <string>
+
+DeferredLightProgram::DeferredLightProgram() {
+	program = compile_program(
+		//this draws a triangle that covers the entire screen:
+		"#version 330\n"
+		"void main() {\n"
+		"	gl_Position = vec4(4 * (gl_VertexID & 1) - 1,  2 * (gl_VertexID & 2) - 1, 0.0, 1.0);\n"
+		"}\n"
+		,
+		"#version 330\n"
+		+ std::string(frame_block_glsl)
+		+ light_block_glsl
+		+ texture_lighting_glsl +
+		"uniform sampler2D albedo_tex;\n"
+		"uniform sampler2D normal_tex;\n"
+		"uniform sampler2D position_tex;\n"
+		"out vec4 fragColor;\n"
+		"void main() {\n"
+		"	ivec2 px = ivec2(gl_FragCoord.xy);\n"
+		"	vec4 albedo = texelFetch(albedo_tex, px, 0);\n"
+		"	if (albedo.a == 0.0) discard;\n" //(nothing drawn here)
+		"	vec3 position = texelFetch(position_tex, px, 0).xyz;\n"
+		"	vec3 n = texelFetch(normal_tex, px, 0).xyz;\n"
+		"	vec4 at_spot = light_to_spot * vec4(position, 1.0);\n"
+		"	vec3 total_light = ambient * sky_and_sun_light(n)\n"
+		"		+ spot_light(position, n, at_spot, spot_position, spot_direction, spot_color, spot_outer_inner, spot_shadowed);\n"
+		"	fragColor = vec4(albedo.rgb * total_light, albedo.a);\n"
+		"}\n"
+	);
+
+	bind_uniform_blocks(program);
+
+	glUseProgram(program);
+
+	glUniform1i(glGetUniformLocation(program, "albedo_tex"), 0);
+	glUniform1i(glGetUniformLocation(program, "spot_depth_tex"), 1);
+	glUniform1i(glGetUniformLocation(program, "normal_tex"), 2);
+	glUniform1i(glGetUniformLocation(program, "position_tex"), 3);
+	glUniform1i(glGetUniformLocation(program, "wall_tex"), 4);
+
+	glUseProgram(0);
+
+	GL_ERRORS();
+}
+
+Load< DeferredLightProgram > deferred_light_program(LoadTagInit, [](){
+	return new DeferredLightProgram();
+});
+
+LightVolumeProgram::LightVolumeProgram() {
+	program = compile_program(
+		"#version 330\n"
+		"uniform mat4 volume_to_clip;\n"
+		"const vec3 corners[18] = vec3[18](\n"
+		//base:
+		"	vec3(-1.0,-1.0,-1.0), vec3( 1.0, 1.0,-1.0), vec3( 1.0,-1.0,-1.0),\n"
+		"	vec3(-1.0,-1.0,-1.0), vec3(-1.0, 1.0,-1.0), vec3( 1.0, 1.0,-1.0),\n"
+		//sides:
+		"	vec3( 0.0, 0.0, 0.0), vec3(-1.0,-1.0,-1.0), vec3( 1.0,-1.0,-1.0),\n"
+		"	vec3( 0.0, 0.0, 0.0), vec3( 1.0,-1.0,-1.0), vec3( 1.0, 1.0,-1.0),\n"
+		"	vec3( 0.0, 0.0, 0.0), vec3( 1.0, 1.0,-1.0), vec3(-1.0, 1.0,-1.0),\n"
+		"	vec3( 0.0, 0.0, 0.0), vec3(-1.0, 1.0,-1.0), vec3(-1.0,-1.0,-1.0)\n"
+		");\n"
+		"void main() {\n"
+		"	gl_Position = volume_to_clip * vec4(corners[gl_VertexID], 1.0);\n"
+		"}\n"
+		,
+		"#version 330\n"
+		"out vec4 fragColor;\n"
+		"void main() {\n"
+		"	fragColor = vec4(1.0);\n" //(only the stencil buffer is written)
+		"}\n"
+	);
+
+	volume_to_clip_mat4 = glGetUniformLocation(program, "volume_to_clip");
+
+	GL_ERRORS();
+}
+
+Load< LightVolumeProgram > light_volume_program(LoadTagInit, [](){
+	return new LightVolumeProgram();
+});
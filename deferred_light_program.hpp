@@ -0,0 +1,37 @@
+#include "GL.hpp"
+#include "Load.hpp"
+
+//DeferredLightProgram lights the surfaces stored in a G-buffer (see TextureProgram's 'gbuffer' variant),
+// using the same lighting as TextureProgram, with the Frame and Light uniform blocks.
+//It is drawn as a single triangle covering the screen (three vertices, no attributes):
+struct DeferredLightProgram {
+	//opengl program object:
+	GLuint program = 0;
+
+	//textures:
+	//texture0 - surface color (G-buffer attachment 0)
+	//texture1 - shadow atlas
+	//texture2 - surface normal (G-buffer attachment 1)
+	//texture3 - surface position (G-buffer attachment 2)
+	//texture4 - walls (for grid shadows; see texture_lighting_glsl)
+
+	DeferredLightProgram();
+};
+
+extern Load< DeferredLightProgram > deferred_light_program;
+
+//LightVolumeProgram draws a spot light's volume (the square pyramid its frustum makes, out to its range)
+// so that deferred lighting can mark, in the stencil buffer, the pixels whose surfaces lie inside it.
+//The pyramid is built in the vertex shader (18 vertices, no attributes), with its apex at the origin,
+// pointing along -z, with base corners at (+/-1, +/-1, -1); faces are wound counter-clockwise seen from outside:
+struct LightVolumeProgram {
+	//opengl program object:
+	GLuint program = 0;
+
+	//uniform locations:
+	GLuint volume_to_clip_mat4 = -1U;
+
+	LightVolumeProgram();
+};
+
+extern Load< LightVolumeProgram > light_volume_program;
@@ -1,11 +1,18 @@
 #include "depth_program.hpp"
 
 #include "compile_program.hpp"
+#include "Scene.hpp"
 
-DepthProgram::DepthProgram() {
+#include <string>
+
+DepthProgram::DepthProgram(bool instanced) {
 	program = compile_program(
 		"#version 330\n"
-		"uniform mat4 object_to_clip;\n"
+		"invariant gl_Position;\n" //(depths must match texture_program's exactly for a depth pre-pass)
+		+ std::string(instanced
+			? "layout(location=" + std::to_string(Scene::InstanceObjectToClipLocation) + ") in mat4 object_to_clip;\n"
+			: "uniform mat4 object_to_clip;\n"
+		) +
 		"layout(location=0) in vec4 Position;\n" //note: layout keyword used to make sure that the location-0 attribute is always bound to something
 		"in vec3 Normal;\n" //DEBUG
 		"out vec3 color;\n" //DEBUG
@@ -29,3 +36,68 @@ DepthProgram::DepthProgram() {
 Load< DepthProgram > depth_program(LoadTagInit, [](){
 	return new DepthProgram();
 });
+
+Load< DepthProgram > depth_program_instanced(LoadTagInit, [](){
+	return new DepthProgram(true);
+});
+
+LayeredDepthProgram::LayeredDepthProgram() {
+	std::string max_layers = std::to_string(MaxLayers);
+	program = compile_program(
+		"#version 330\n"
+		"uniform mat4x3 object_to_world;\n"
+		"layout(location=0) in vec4 Position;\n"
+		"out vec4 worldPosition;\n"
+		"void main() {\n"
+		"	worldPosition = vec4(object_to_world * Position, 1.0);\n"
+		"}\n"
+		,
+		"#version 330\n"
+		"layout(triangles) in;\n"
+		"layout(triangle_strip, max_vertices = " + std::to_string(3 * MaxLayers) + ") out;\n"
+		"uniform uint layer_mask;\n"
+		"uniform mat4 layer_world_to_clip[" + max_layers + "];\n"
+		"uniform vec4 layer_tile[" + max_layers + "];\n"
+		"in vec4 worldPosition[];\n"
+		"out float gl_ClipDistance[4];\n"
+		"void main() {\n"
+		"	for (int l = 0; l < " + max_layers + "; ++l) {\n"
+		"		if ((layer_mask & (1u << uint(l))) == 0u) continue;\n"
+		"		vec4 clip[3];\n"
+		"		for (int v = 0; v < 3; ++v) clip[v] = layer_world_to_clip[l] * worldPosition[v];\n"
+		//skip the layer if the triangle is wholly outside one of its frustum's planes:
+		"		bool outside = false;\n"
+		"		for (int c = 0; c < 3; ++c) {\n"
+		"			outside = outside || (clip[0][c] < -clip[0].w && clip[1][c] < -clip[1].w && clip[2][c] < -clip[2].w);\n"
+		"			outside = outside || (clip[0][c] > clip[0].w && clip[1][c] > clip[1].w && clip[2][c] > clip[2].w);\n"
+		"		}\n"
+		"		if (outside) continue;\n"
+		"		for (int v = 0; v < 3; ++v) {\n"
+		//(clipped to the layer's own [-1,1] square, so nothing spills into its neighbors' tiles)
+		"			gl_ClipDistance[0] = clip[v].w + clip[v].x;\n"
+		"			gl_ClipDistance[1] = clip[v].w - clip[v].x;\n"
+		"			gl_ClipDistance[2] = clip[v].w + clip[v].y;\n"
+		"			gl_ClipDistance[3] = clip[v].w - clip[v].y;\n"
+		"			gl_Position = vec4(clip[v].xy * layer_tile[l].xy + clip[v].w * layer_tile[l].zw, clip[v].zw);\n"
+		"			EmitVertex();\n"
+		"		}\n"
+		"		EndPrimitive();\n"
+		"	}\n"
+		"}\n"
+		,
+		"#version 330\n"
+		"out vec4 fragColor;\n"
+		"void main() {\n"
+		"	fragColor = vec4(1.0);\n"
+		"}\n"
+	);
+
+	object_to_world_mat4x3 = glGetUniformLocation(program, "object_to_world");
+	layer_mask_uint = glGetUniformLocation(program, "layer_mask");
+	layer_world_to_clip_mat4 = glGetUniformLocation(program, "layer_world_to_clip");
+	layer_tile_vec4 = glGetUniformLocation(program, "layer_tile");
+}
+
+Load< LayeredDepthProgram > layered_depth_program(LoadTagInit, [](){
+	return new LayeredDepthProgram();
+});
@@ -8,7 +8,30 @@ struct DepthProgram {
 	//uniform locations:
 	GLuint object_to_clip_mat4 = -1U;
 
-	DepthProgram();
+	//if 'instanced', object_to_clip is a per-instance attribute (at Scene::InstanceObjectToClipLocation) rather than a uniform:
+	DepthProgram(bool instanced = false);
 };
 
 extern Load< DepthProgram > depth_program;
+extern Load< DepthProgram > depth_program_instanced;
+
+//"LayeredDepthProgram" draws depth into several views at once -- e.g., the shadow maps of several lights, each in a tile of an atlas:
+// the geometry shader sends each triangle to the layers set in layer_mask (and not wholly outside that layer's frustum),
+// in layer l's view (layer_world_to_clip[l]), moved into its part of the target (layer_tile[l]) and clipped to stay there.
+// (see Scene::LayeredPass; clip distances 0-3 must be enabled while drawing)
+struct LayeredDepthProgram {
+	//opengl program object:
+	GLuint program = 0;
+
+	//uniform locations:
+	GLuint object_to_world_mat4x3 = -1U;
+	GLuint layer_mask_uint = -1U;
+	GLuint layer_world_to_clip_mat4 = -1U; //array of MaxLayers
+	GLuint layer_tile_vec4 = -1U; //array of MaxLayers: (scale.xy, center.xy) of each layer's part of the target, in its normalized device coordinates
+
+	enum : uint32_t { MaxLayers = 16 }; //(bits of layer_mask; bounded by geometry shader output limits)
+
+	LayeredDepthProgram();
+};
+
+extern Load< LayeredDepthProgram > layered_depth_program;
@@ -0,0 +1,161 @@
+#include "light_tiles.hpp"
+
+#include "gl_errors.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <cassert>
+
+void LightTiles::clear(glm::uvec2 const &drawable_size) {
+	size = drawable_size;
+	count = (size + glm::uvec2(TileSize - 1)) / uint32_t(TileSize);
+	masks.assign(count.x * count.y, 0);
+}
+
+void LightTiles::add(uint32_t index, glm::mat4 const &world_to_clip, std::vector< glm::vec3 > const &points) {
+	if (points.empty()) return;
+	glm::vec2 min, max;
+	screen_bounds(world_to_clip, size, points, &min, &max);
+	add(index, min, max);
+}
+
+void LightTiles::add(uint32_t index, glm::vec2 const &min, glm::vec2 const &max) {
+	assert(index < MaxLights);
+	if (count.x == 0 || count.y == 0) return;
+	if (max.x < 0.0f || max.y < 0.0f || min.x >= float(size.x) || min.y >= float(size.y)) return; //off screen
+	glm::ivec2 lo = glm::max(glm::ivec2(glm::floor(min / float(TileSize))), glm::ivec2(0));
+	glm::ivec2 hi = glm::min(glm::ivec2(glm::floor(max / float(TileSize))), glm::ivec2(count) - 1);
+	uint32_t bit = 1U << index;
+	for (int32_t y = lo.y; y <= hi.y; ++y) {
+		for (int32_t x = lo.x; x <= hi.x; ++x) {
+			masks[y * count.x + x] |= bit;
+		}
+	}
+}
+
+void LightTiles::upload() {
+	if (count.x == 0 || count.y == 0) return;
+	if (tex == 0) {
+		glGenTextures(1, &tex);
+		glBindTexture(GL_TEXTURE_2D, tex);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	} else {
+		glBindTexture(GL_TEXTURE_2D, tex);
+	}
+	if (tex_count != count) {
+		tex_count = count;
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_R32UI, count.x, count.y, 0, GL_RED_INTEGER, GL_UNSIGNED_INT, masks.data());
+	} else {
+		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, count.x, count.y, GL_RED_INTEGER, GL_UNSIGNED_INT, masks.data());
+	}
+	glBindTexture(GL_TEXTURE_2D, 0);
+	GL_ERRORS();
+}
+
+void screen_bounds(glm::mat4 const &world_to_clip, glm::uvec2 const &size, std::vector< glm::vec3 > const &points, glm::vec2 *min_, glm::vec2 *max_) {
+	assert(min_ && max_);
+	glm::vec2 min = glm::vec2(std::numeric_limits< float >::infinity());
+	glm::vec2 max = -min;
+	for (glm::vec3 const &point : points) {
+		glm::vec4 clip = world_to_clip * glm::vec4(point, 1.0f);
+		if (clip.w <= 1e-4f) {
+			//(projection of points near or behind the eye is unbounded)
+			min = glm::vec2(0.0f);
+			max = glm::vec2(size);
+			break;
+		}
+		glm::vec2 px = (0.5f * glm::vec2(clip) / clip.w + 0.5f) * glm::vec2(size);
+		min = glm::min(min, px);
+		max = glm::max(max, px);
+	}
+	*min_ = min;
+	*max_ = max;
+}
+
+LightTiles::~LightTiles() {
+	if (tex != 0) {
+		glDeleteTextures(1, &tex);
+		tex = 0;
+	}
+}
+
+//---------------------------
+
+//keep the part of a convex polygon where dot(plane.xyz, p) + plane.w >= 0:
+static void clip_polygon(std::vector< glm::vec3 > *polygon_, glm::vec4 const &plane, std::vector< glm::vec3 > *scratch_) {
+	std::vector< glm::vec3 > &polygon = *polygon_;
+	std::vector< glm::vec3 > &out = *scratch_;
+	out.clear();
+	for (uint32_t i = 0; i < polygon.size(); ++i) {
+		glm::vec3 const &a = polygon[i];
+		glm::vec3 const &b = polygon[(i + 1) % polygon.size()];
+		float da = glm::dot(glm::vec3(plane), a) + plane.w;
+		float db = glm::dot(glm::vec3(plane), b) + plane.w;
+		if (da >= 0.0f) out.emplace_back(a);
+		if ((da >= 0.0f) != (db >= 0.0f)) {
+			out.emplace_back(a + (b - a) * (da / (da - db)));
+		}
+	}
+	polygon.swap(out);
+}
+
+bool spot_volume_in_box(glm::mat4 const &spot_to_world, float fov, float range,
+	glm::vec3 const &box_min, glm::vec3 const &box_max, std::vector< glm::vec3 > *points_) {
+	assert(points_);
+	std::vector< glm::vec3 > &points = *points_;
+	points.clear();
+
+	//corners of the pyramid:
+	float r = range * std::tan(0.5f * fov);
+	glm::vec3 apex = glm::vec3(spot_to_world * glm::vec4(0.0f, 0.0f, 0.0f, 1.0f));
+	glm::vec3 base[4] = {
+		glm::vec3(spot_to_world * glm::vec4(-r,-r,-range, 1.0f)),
+		glm::vec3(spot_to_world * glm::vec4( r,-r,-range, 1.0f)),
+		glm::vec3(spot_to_world * glm::vec4( r, r,-range, 1.0f)),
+		glm::vec3(spot_to_world * glm::vec4(-r, r,-range, 1.0f)),
+	};
+
+	glm::vec4 box_planes[6] = {
+		glm::vec4( 1.0f, 0.0f, 0.0f,-box_min.x),
+		glm::vec4(-1.0f, 0.0f, 0.0f, box_max.x),
+		glm::vec4( 0.0f, 1.0f, 0.0f,-box_min.y),
+		glm::vec4( 0.0f,-1.0f, 0.0f, box_max.y),
+		glm::vec4( 0.0f, 0.0f, 1.0f,-box_min.z),
+		glm::vec4( 0.0f, 0.0f,-1.0f, box_max.z),
+	};
+
+	//the corners of the intersection are the corners of the pyramid's faces clipped to the box...
+	std::vector< glm::vec3 > face, scratch;
+	for (uint32_t f = 0; f < 5; ++f) {
+		face.clear();
+		if (f < 4) {
+			face.emplace_back(apex);
+			face.emplace_back(base[f]);
+			face.emplace_back(base[(f + 1) % 4]);
+		} else {
+			face.assign(base, base + 4);
+		}
+		for (uint32_t p = 0; p < 6 && !face.empty(); ++p) {
+			clip_polygon(&face, box_planes[p], &scratch);
+		}
+		points.insert(points.end(), face.begin(), face.end());
+	}
+
+	//...plus the corners of the box inside the pyramid:
+	glm::mat4 world_to_spot = glm::inverse(spot_to_world);
+	float slope = r / range;
+	for (uint32_t c = 0; c < 8; ++c) {
+		glm::vec3 corner((c & 1) ? box_max.x : box_min.x, (c & 2) ? box_max.y : box_min.y, (c & 4) ? box_max.z : box_min.z);
+		glm::vec3 local = glm::vec3(world_to_spot * glm::vec4(corner, 1.0f));
+		float depth = -local.z;
+		if (depth >= 0.0f && depth <= range && std::abs(local.x) <= slope * depth && std::abs(local.y) <= slope * depth) {
+			points.emplace_back(corner);
+		}
+	}
+
+	return !points.empty();
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include "GL.hpp"
+
+#include <glm/glm.hpp>
+
+#include <vector>
+#include <cstdint>
+
+//"LightTiles" divides the screen into square tiles and records which lights may reach each one,
+// so that a shader lighting a pixel only has to consider the lights listed for its tile.
+// The lists are bit masks (bit i for light i), uploaded as a GL_R32UI texture with one texel per tile.
+struct LightTiles {
+	enum : uint32_t {
+		TileSize = 32, //pixels
+		MaxLights = 32, //bits per mask
+	};
+
+	//start over for a screen of the given size (no lights in any tile):
+	void clear(glm::uvec2 const &drawable_size);
+	//add light 'index' to every tile covered by the screen-space bounds of the convex hull of 'points':
+	// (if any point is behind the camera, the light is added to every tile)
+	void add(uint32_t index, glm::mat4 const &world_to_clip, std::vector< glm::vec3 > const &points);
+	//add light 'index' to every tile overlapping the rectangle [min,max] (in pixels):
+	void add(uint32_t index, glm::vec2 const &min, glm::vec2 const &max);
+	//copy masks to tex (bind as a usampler2D and look up texel ivec2(gl_FragCoord.xy) / TileSize):
+	void upload();
+
+	glm::uvec2 size = glm::uvec2(0); //screen size in pixels
+	glm::uvec2 count = glm::uvec2(0); //tiles across and up
+	std::vector< uint32_t > masks; //count.x * count.y masks, rows from the bottom of the screen
+
+	GLuint tex = 0;
+	glm::uvec2 tex_count = glm::uvec2(0); //size tex was allocated with
+
+	LightTiles() = default;
+	LightTiles(LightTiles const &) = delete;
+	~LightTiles();
+};
+
+//Find the rectangle (in pixels) covered by the projection of the convex hull of 'points' onto a screen of size 'size':
+// (if any point is behind the camera, this is the whole screen; if there are no points, min > max)
+void screen_bounds(glm::mat4 const &world_to_clip, glm::uvec2 const &size, std::vector< glm::vec3 > const &points, glm::vec2 *min, glm::vec2 *max);
+
+//Find the part of a spot light's reach that lies within a box (e.g., around all visible surfaces):
+// the light reaches a square pyramid with apex at the origin of 'spot_to_world', pointing along its -z axis,
+// with (full) opening angle 'fov' and height 'range'.
+// On return, 'points' holds the corners of the intersection; returns false if it is empty.
+bool spot_volume_in_box(glm::mat4 const &spot_to_world, float fov, float range,
+	glm::vec3 const &box_min, glm::vec3 const &box_max, std::vector< glm::vec3 > *points);
@@ -0,0 +1,162 @@
+#include "maze_mesh.hpp"
+
+#include "MeshBuffer.hpp"
+
+#include <vector>
+#include <algorithm>
+#include <stdexcept>
+#include <cassert>
+#include <cstring>
+
+void build_maze_mesh(glm::uvec2 const &size, std::function< bool(uint32_t x, uint32_t y) > const &is_wall,
+	float bottom, float top, MeshBuffer const &layout, Scene::StaticBatch *batch, uint32_t block_size) {
+	assert(batch && "Must have a batch to build into.");
+	assert(block_size > 0);
+	if (layout.Position.size != 3 || layout.Position.type != GL_FLOAT) {
+		throw std::runtime_error("Maze mesh layout must have float3 positions.");
+	}
+
+	//walls are padded outward a bit so that no cracks show along edges where quads meet:
+	// (the same amount as the 1.001 scale that was used for cube walls)
+	const float pad = 0.0005f;
+	//texture coordinates per unit of world space (matches 'Cube', which maps half the texture to each face):
+	const float tex_scale = 0.5f;
+
+	bool has_normal = (layout.Normal.size == 3 && layout.Normal.type == GL_FLOAT);
+	bool has_color = (layout.Color.size == 4 && layout.Color.type == GL_UNSIGNED_BYTE);
+	bool has_tex_coord = (layout.TexCoord.size == 2 && layout.TexCoord.type == GL_FLOAT);
+	GLsizei stride = layout.Position.stride;
+
+	batch->vertex_data.clear();
+	batch->ranges.clear();
+
+	auto wall = [&](int32_t x, int32_t y) {
+		//cells outside the grid count as walls, so the outside of the border is skipped:
+		if (x < 0 || y < 0 || uint32_t(x) >= size.x || uint32_t(y) >= size.y) return true;
+		return is_wall(uint32_t(x), uint32_t(y));
+	};
+
+	auto emit_vertex = [&](glm::vec3 const &position, glm::vec3 const &normal, glm::vec2 const &tex_coord) {
+		size_t at = batch->vertex_data.size();
+		batch->vertex_data.resize(at + stride, 0);
+		char *dst = &batch->vertex_data[at];
+		std::memcpy(dst + layout.Position.offset, &position, sizeof(position));
+		if (has_normal) std::memcpy(dst + layout.Normal.offset, &normal, sizeof(normal));
+		if (has_color) {
+			glm::u8vec4 color(0xff);
+			std::memcpy(dst + layout.Color.offset, &color, sizeof(color));
+		}
+		if (has_tex_coord) std::memcpy(dst + layout.TexCoord.offset, &tex_coord, sizeof(tex_coord));
+
+		Scene::StaticBatch::Range &range = batch->ranges.back();
+		if (range.count == 0) {
+			range.min = range.max = position;
+		} else {
+			range.min = glm::min(range.min, position);
+			range.max = glm::max(range.max, position);
+		}
+		range.count += 1;
+	};
+
+	//emit quad corner, corner+u, corner+u+v, corner+v (counterclockwise when cross(u,v) points along normal);
+	// tex_axes picks the world axes that texture coordinates are taken from:
+	auto emit_quad = [&](glm::vec3 const &corner, glm::vec3 const &u, glm::vec3 const &v, glm::vec3 const &normal, glm::uvec2 const &tex_axes) {
+		glm::vec3 corners[4] = { corner, corner + u, corner + u + v, corner + v };
+		glm::vec2 tex_coords[4];
+		for (uint32_t i = 0; i < 4; ++i) {
+			tex_coords[i] = tex_scale * glm::vec2(corners[i][tex_axes.x], corners[i][tex_axes.y]);
+		}
+		static const uint32_t order[6] = { 0, 1, 2, 0, 2, 3 };
+		for (uint32_t i : order) {
+			emit_vertex(corners[i], normal, tex_coords[i]);
+		}
+	};
+
+	float height = top - bottom;
+
+	for (uint32_t by = 0; by < size.y; by += block_size) {
+		for (uint32_t bx = 0; bx < size.x; bx += block_size) {
+			uint32_t ex = std::min(size.x, bx + block_size);
+			uint32_t ey = std::min(size.y, by + block_size);
+
+			batch->ranges.emplace_back();
+			batch->ranges.back().start = GLuint(batch->vertex_data.size() / stride);
+
+			{ //tops: greedily grow rectangles of wall cells, first along x then along y:
+				std::vector< bool > done((ex - bx) * (ey - by), false);
+				auto is_done = [&](uint32_t x, uint32_t y) { return done[(y - by) * (ex - bx) + (x - bx)]; };
+				for (uint32_t y = by; y < ey; ++y) {
+					for (uint32_t x = bx; x < ex; ++x) {
+						if (is_done(x, y) || !wall(x, y)) continue;
+						uint32_t x1 = x + 1;
+						while (x1 < ex && !is_done(x1, y) && wall(x1, y)) ++x1;
+						uint32_t y1 = y + 1;
+						while (y1 < ey) {
+							bool row = true;
+							for (uint32_t t = x; t < x1 && row; ++t) {
+								row = !is_done(t, y1) && wall(t, y1);
+							}
+							if (!row) break;
+							++y1;
+						}
+						for (uint32_t v = y; v < y1; ++v) {
+							for (uint32_t u = x; u < x1; ++u) {
+								done[(v - by) * (ex - bx) + (u - bx)] = true;
+							}
+						}
+						emit_quad(
+							glm::vec3(x - 0.5f - pad, y - 0.5f - pad, top),
+							glm::vec3(x1 - x + 2.0f * pad, 0.0f, 0.0f),
+							glm::vec3(0.0f, y1 - y + 2.0f * pad, 0.0f),
+							glm::vec3(0.0f, 0.0f, 1.0f), glm::uvec2(0, 1)
+						);
+					}
+				}
+			}
+
+			//sides: walls are one cell tall, so faces only merge into runs along the wall:
+			for (int32_t dir = -1; dir <= 1; dir += 2) {
+				float side = dir * (0.5f + pad);
+
+				//faces pointing along +/-x, merged along y:
+				for (uint32_t x = bx; x < ex; ++x) {
+					for (uint32_t y = by; y < ey; /* later */) {
+						if (!(wall(x, y) && !wall(int32_t(x) + dir, y))) {
+							++y;
+							continue;
+						}
+						uint32_t y1 = y + 1;
+						while (y1 < ey && wall(x, y1) && !wall(int32_t(x) + dir, y1)) ++y1;
+						glm::vec3 run(0.0f, y1 - y + 2.0f * pad, 0.0f);
+						glm::vec3 up(0.0f, 0.0f, height);
+						glm::vec3 corner(x + side, y - 0.5f - pad, bottom);
+						if (dir > 0) emit_quad(corner, run, up, glm::vec3(1.0f, 0.0f, 0.0f), glm::uvec2(1, 2));
+						else emit_quad(corner, up, run, glm::vec3(-1.0f, 0.0f, 0.0f), glm::uvec2(1, 2));
+						y = y1;
+					}
+				}
+
+				//faces pointing along +/-y, merged along x:
+				for (uint32_t y = by; y < ey; ++y) {
+					for (uint32_t x = bx; x < ex; /* later */) {
+						if (!(wall(x, y) && !wall(x, int32_t(y) + dir))) {
+							++x;
+							continue;
+						}
+						uint32_t x1 = x + 1;
+						while (x1 < ex && wall(x1, y) && !wall(x1, int32_t(y) + dir)) ++x1;
+						glm::vec3 run(x1 - x + 2.0f * pad, 0.0f, 0.0f);
+						glm::vec3 up(0.0f, 0.0f, height);
+						glm::vec3 corner(x - 0.5f - pad, y + side, bottom);
+						if (dir > 0) emit_quad(corner, up, run, glm::vec3(0.0f, 1.0f, 0.0f), glm::uvec2(0, 2));
+						else emit_quad(corner, run, up, glm::vec3(0.0f,-1.0f, 0.0f), glm::uvec2(0, 2));
+						x = x1;
+					}
+				}
+			}
+
+			//blocks without any exposed faces don't need a range:
+			if (batch->ranges.back().count == 0) batch->ranges.pop_back();
+		}
+	}
+}
@@ -0,0 +1,19 @@
+#pragma once
+
+#include "Scene.hpp"
+
+#include <glm/glm.hpp>
+
+#include <functional>
+
+struct MeshBuffer;
+
+//Build world-space geometry for a grid of unit wall cells (cell (x,y) is centered at (x,y) and spans z in [bottom,top]):
+// - only wall tops and faces between a wall and an open cell are emitted;
+//   faces resting on the ground, between two walls, or facing off the edge of the grid are never seen
+// - neighboring coplanar faces are merged into larger quads ("greedy meshing");
+//   texture coordinates come from world position, so textures tile seamlessly across merged quads
+// - the grid is split into block_size x block_size blocks, each of which becomes one of batch->ranges (so blocks can be culled)
+// vertices are written laid out like 'layout' (which must have float3 positions); upload with Scene::new_batch_object
+void build_maze_mesh(glm::uvec2 const &size, std::function< bool(uint32_t x, uint32_t y) > const &is_wall,
+	float bottom, float top, MeshBuffer const &layout, Scene::StaticBatch *batch, uint32_t block_size = 4);
@@ -0,0 +1,118 @@
+#include "post_chain.hpp"
+
+#include "gl_errors.hpp"
+#include "check_fb.hpp"
+
+#include <stdexcept>
+#include <cassert>
+
+char const *PostChain::vertex_shader =
+	"#version 330\n"
+	"out vec2 texCoord;\n"
+	"void main() {\n"
+	"	gl_Position = vec4(4 * (gl_VertexID & 1) - 1,  2 * (gl_VertexID & 2) - 1, 0.0, 1.0);\n"
+	"	texCoord = 0.5 * gl_Position.xy + 0.5;\n"
+	"}\n"
+;
+
+void PostChain::run(GLuint scene_fb, GLuint scene_tex, glm::uvec2 const &size, GLuint target_fb) {
+	uint32_t last = -1U; //(last enabled effect)
+	for (uint32_t i = 0; i < effects.size(); ++i) {
+		if (effects[i].enabled) last = i;
+	}
+
+	if (last == -1U) {
+		//nothing to do but copy:
+		glBindFramebuffer(GL_READ_FRAMEBUFFER, scene_fb);
+		glBindFramebuffer(GL_DRAW_FRAMEBUFFER, target_fb);
+		glBlitFramebuffer(0, 0, size.x, size.y, 0, 0, size.x, size.y, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+		glBindFramebuffer(GL_FRAMEBUFFER, target_fb);
+		GL_ERRORS();
+		return;
+	}
+
+	if (targets.size() < effects.size()) targets.resize(effects.size());
+	outputs.assign(effects.size(), 0);
+
+	auto find_input = [&](uint32_t index, std::string const &name) -> GLuint {
+		if (name == "scene") return scene_tex;
+		for (uint32_t i = 0; i < index; ++i) {
+			if (effects[i].name == name) return outputs[i];
+		}
+		throw std::runtime_error("Post-processing effect '" + effects[index].name + "' reads '" + name + "', which is not an earlier effect.");
+	};
+
+	//(full-screen triangles replace what they cover)
+	glDisable(GL_DEPTH_TEST);
+	glDisable(GL_BLEND);
+
+	if (vao == 0) glGenVertexArrays(1, &vao); //(effects' vertex shader needs no attributes)
+	glBindVertexArray(vao);
+
+	for (uint32_t i = 0; i <= last; ++i) {
+		Effect const &effect = effects[i];
+		if (!effect.enabled) {
+			outputs[i] = (effect.inputs.empty() ? scene_tex : find_input(i, effect.inputs[0]));
+			continue;
+		}
+
+		if (i == last) {
+			glBindFramebuffer(GL_FRAMEBUFFER, target_fb);
+			glViewport(0, 0, size.x, size.y);
+		} else {
+			assert(effect.downsample == 1 || effect.downsample == 2 || effect.downsample == 4);
+			Target &target = targets[i];
+			glm::uvec2 target_size = glm::max(size / std::max(1U, effect.downsample), glm::uvec2(1));
+			if (target.size != target_size) {
+				target.size = target_size;
+				if (target.tex == 0) glGenTextures(1, &target.tex);
+				glBindTexture(GL_TEXTURE_2D, target.tex);
+				glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, target.size.x, target.size.y, 0, GL_RGB, GL_UNSIGNED_BYTE, NULL);
+				glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+				glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+				glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+				glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+				glBindTexture(GL_TEXTURE_2D, 0);
+
+				if (target.fb == 0) glGenFramebuffers(1, &target.fb);
+				glBindFramebuffer(GL_FRAMEBUFFER, target.fb);
+				glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, target.tex, 0);
+				check_fb();
+			}
+			glBindFramebuffer(GL_FRAMEBUFFER, target.fb);
+			glViewport(0, 0, target.size.x, target.size.y);
+			outputs[i] = target.tex;
+		}
+
+		for (uint32_t t = 0; t < effect.inputs.size(); ++t) {
+			glActiveTexture(GL_TEXTURE0 + t);
+			glBindTexture(GL_TEXTURE_2D, find_input(i, effect.inputs[t]));
+		}
+		glUseProgram(effect.program);
+		if (effect.set_uniforms) effect.set_uniforms();
+		glDrawArrays(GL_TRIANGLES, 0, 3);
+
+		for (uint32_t t = 0; t < effect.inputs.size(); ++t) {
+			glActiveTexture(GL_TEXTURE0 + t);
+			glBindTexture(GL_TEXTURE_2D, 0);
+		}
+		glActiveTexture(GL_TEXTURE0);
+	}
+
+	glUseProgram(0);
+	glBindVertexArray(0);
+
+	GL_ERRORS();
+}
+
+PostChain::~PostChain() {
+	for (Target &target : targets) {
+		if (target.fb != 0) glDeleteFramebuffers(1, &target.fb);
+		if (target.tex != 0) glDeleteTextures(1, &target.tex);
+	}
+	targets.clear();
+	if (vao != 0) {
+		glDeleteVertexArrays(1, &vao);
+		vao = 0;
+	}
+}
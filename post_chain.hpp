@@ -0,0 +1,47 @@
+#pragma once
+
+#include "GL.hpp"
+
+#include <glm/glm.hpp>
+
+#include <vector>
+#include <string>
+#include <functional>
+#include <cstdint>
+
+//"PostChain" copies a rendered scene to its final framebuffer through a list of full-screen effects.
+// Each effect reads textures by name -- "scene", or an earlier effect's name for its output -- and writes one output,
+// at full, half, or quarter resolution (outputs are read with bilinear filtering, so smaller ones upsample smoothly).
+// The last enabled effect draws straight into the final framebuffer; with no effect enabled, the scene is just blitted there.
+struct PostChain {
+	struct Effect {
+		std::string name; //(names the effect's output)
+		GLuint program = 0; //draws a full-screen triangle; its vertex shader is PostChain::vertex_shader
+		std::vector< std::string > inputs; //textures to bind, to units 0, 1, ... in order
+		uint32_t downsample = 1; //output is the scene's size divided by this (1, 2, or 4)
+		bool enabled = true; //(a disabled effect costs nothing; its output is its first input, unchanged)
+		std::function< void() > set_uniforms; //(optional) called with 'program' bound
+	};
+	std::vector< Effect > effects;
+
+	//run the enabled effects over scene_tex, color attachment 0 of scene_fb (both 'size'), leaving the result in target_fb:
+	// (throws if an effect reads a name that is not "scene" or an earlier effect)
+	void run(GLuint scene_fb, GLuint scene_tex, glm::uvec2 const &size, GLuint target_fb = 0);
+
+	//vertex shader for effects; it covers the target with a triangle and passes on its [0,1]^2 coordinates as 'texCoord':
+	static char const *vertex_shader;
+
+	//internals:
+	struct Target {
+		glm::uvec2 size = glm::uvec2(0);
+		GLuint tex = 0;
+		GLuint fb = 0;
+	};
+	std::vector< Target > targets; //per effect (allocated when it first writes a texture rather than the final framebuffer)
+	std::vector< GLuint > outputs; //(scratch space: texture holding each effect's output)
+	GLuint vao = 0; //(empty)
+
+	PostChain() = default;
+	PostChain(PostChain const &) = delete;
+	~PostChain();
+};
@@ -0,0 +1,83 @@
+#include "shadow_atlas.hpp"
+
+#include <cassert>
+
+ShadowAtlas::ShadowAtlas(uint32_t size_, uint32_t min_tile_) : size(size_), min_tile(min_tile_) {
+	assert(size != 0 && (size & (size - 1)) == 0 && "Atlas size must be a power of two.");
+	assert(min_tile != 0 && (min_tile & (min_tile - 1)) == 0 && min_tile <= size && "Minimum tile size must be a power of two no larger than the atlas.");
+	uint32_t count = 0;
+	for (uint32_t tile = size; tile >= min_tile; tile /= 2) {
+		count = count * 4 + 1;
+		++levels;
+	}
+	nodes.assign(count, Free);
+}
+
+bool ShadowAtlas::allocate(uint32_t tile_size, Tile *tile) {
+	assert(tile);
+	uint32_t level = levels - 1;
+	uint32_t rounded = min_tile;
+	while (rounded < tile_size && level > 0) {
+		rounded *= 2;
+		--level;
+	}
+	if (rounded < tile_size) return false; //(larger than the whole atlas)
+
+	//first look for a free node of the right size under already-split nodes, then split a larger free node:
+	glm::uvec2 offset;
+	uint32_t node = find(0, 0, level, false, glm::uvec2(0), &offset);
+	if (node == -1U) node = find(0, 0, level, true, glm::uvec2(0), &offset);
+	if (node == -1U) return false;
+
+	nodes[node] = Used;
+	tile->offset = offset;
+	tile->size = rounded;
+	tile->node = node;
+	used_texels += uint64_t(rounded) * uint64_t(rounded);
+	return true;
+}
+
+uint32_t ShadowAtlas::find(uint32_t node, uint32_t level, uint32_t target_level, bool split, glm::uvec2 offset, glm::uvec2 *found_offset) {
+	if (level == target_level) {
+		if (nodes[node] != Free) return -1U;
+		*found_offset = offset;
+		return node;
+	}
+	if (nodes[node] == Used) return -1U;
+	if (nodes[node] == Free) {
+		if (!split) return -1U;
+		nodes[node] = Split;
+		for (uint32_t c = 0; c < 4; ++c) {
+			nodes[4 * node + 1 + c] = Free;
+		}
+	}
+	uint32_t half = (size >> level) / 2;
+	for (uint32_t c = 0; c < 4; ++c) {
+		glm::uvec2 child_offset = offset + glm::uvec2(c & 1, c >> 1) * half;
+		uint32_t found = find(4 * node + 1 + c, level + 1, target_level, split, child_offset, found_offset);
+		if (found != -1U) return found;
+	}
+	return -1U; //(only possible when not splitting: a node split here always has room)
+}
+
+void ShadowAtlas::free(Tile const &tile) {
+	assert(tile.node < nodes.size() && nodes[tile.node] == Used && "Tile must be in use.");
+	nodes[tile.node] = Free;
+	used_texels -= uint64_t(tile.size) * uint64_t(tile.size);
+
+	//merge runs of four free siblings back into their parent:
+	uint32_t node = tile.node;
+	while (node != 0) {
+		uint32_t parent = (node - 1) / 4;
+		for (uint32_t c = 0; c < 4; ++c) {
+			if (nodes[4 * parent + 1 + c] != Free) return;
+		}
+		nodes[parent] = Free;
+		node = parent;
+	}
+}
+
+void ShadowAtlas::clear() {
+	nodes.assign(nodes.size(), Free);
+	used_texels = 0;
+}
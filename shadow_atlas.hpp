@@ -0,0 +1,43 @@
+#pragma once
+
+#include <glm/glm.hpp>
+
+#include <vector>
+#include <cstdint>
+
+//"ShadowAtlas" hands out square tiles of a shadow map atlas, in power-of-two sizes from min_tile up to the whole atlas.
+// Tiles are kept in a quadtree: each node is free, in use, or split into four nodes of half its size.
+// (no GL calls; the atlas texture itself lives with the framebuffer that draws into it)
+struct ShadowAtlas {
+	ShadowAtlas(uint32_t size = 2048, uint32_t min_tile = 128);
+
+	uint32_t size; //atlas width and height, in texels (a power of two)
+	uint32_t min_tile; //smallest tile handed out (a power of two, at most size)
+
+	struct Tile {
+		glm::uvec2 offset = glm::uvec2(0); //lower-left corner, in texels
+		uint32_t size = 0; //width and height, in texels
+		uint32_t node = -1U; //(used by the atlas to find the tile again)
+	};
+
+	//find a free tile of 'tile_size' (rounded up to a power of two in [min_tile, size]):
+	// (prefers space in already-split nodes, to keep large tiles free; returns false if there is no room)
+	bool allocate(uint32_t tile_size, Tile *tile);
+	//return a tile to the atlas (merging it with its free siblings):
+	void free(Tile const &tile);
+	//return all tiles:
+	void clear();
+
+	//texels in tiles currently handed out:
+	uint64_t used_texels = 0;
+
+	//------ internals ------
+	enum State : uint8_t {
+		Free,
+		Used,
+		Split
+	};
+	std::vector< State > nodes; //complete quadtree; children of node n are 4n+1 ... 4n+4
+	uint32_t levels = 0; //level 0 is the whole atlas, level levels-1 has tiles of min_tile
+	uint32_t find(uint32_t node, uint32_t level, uint32_t target_level, bool split, glm::uvec2 offset, glm::uvec2 *found_offset);
+};
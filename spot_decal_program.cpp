@@ -0,0 +1,56 @@
+#include "spot_decal_program.hpp"
+
+#include "compile_program.hpp"
+#include "gl_errors.hpp"
+#include "texture_program.hpp"
+#include "uniform_blocks.hpp"
+
+#include <string>
+
+SpotDecalProgram::SpotDecalProgram() {
+	program = compile_program(
+		"#version 330\n"
+		+ std::string(frame_block_glsl) +
+		"uniform vec4 rect;\n"
+		"uniform float height;\n"
+		"out vec3 position;\n"
+		"void main() {\n"
+		"	vec2 corner = vec2(gl_VertexID & 1, gl_VertexID >> 1);\n"
+		"	position = vec3(mix(rect.xy, rect.zw, corner), height);\n"
+		"	gl_Position = world_to_clip * vec4(position, 1.0);\n"
+		"}\n"
+		,
+		"#version 330\n"
+		+ std::string(frame_block_glsl)
+		+ light_block_glsl
+		+ texture_lighting_glsl +
+		"uniform vec3 albedo;\n"
+		"in vec3 position;\n"
+		"out vec4 fragColor;\n"
+		"void main() {\n"
+		//(lit as the floor would be by an unshadowed spot)
+		"	vec3 light = spot_light(position, vec3(0.0, 0.0, 1.0), vec4(0.0), spot_position, spot_direction, spot_color, spot_outer_inner, 0.0);\n"
+		"	fragColor = vec4(albedo * light, 0.0);\n"
+		"}\n"
+	);
+
+	rect_vec4 = glGetUniformLocation(program, "rect");
+	height_float = glGetUniformLocation(program, "height");
+	albedo_vec3 = glGetUniformLocation(program, "albedo");
+
+	bind_uniform_blocks(program);
+
+	glUseProgram(program);
+
+	//(not sampled by unshadowed spots, but every sampler type needs a unit of its own)
+	glUniform1i(glGetUniformLocation(program, "spot_depth_tex"), 1);
+	glUniform1i(glGetUniformLocation(program, "wall_tex"), 4);
+
+	glUseProgram(0);
+
+	GL_ERRORS();
+}
+
+Load< SpotDecalProgram > spot_decal_program(LoadTagInit, [](){
+	return new SpotDecalProgram();
+});
@@ -0,0 +1,21 @@
+#pragma once
+
+#include "GL.hpp"
+#include "Load.hpp"
+
+//SpotDecalProgram is the cheap stand-in for a spot light: an unshadowed pool of its light on the floor,
+// drawn additively as a single horizontal rectangle (four vertices as a triangle strip, no attributes).
+//The spot comes from the Light uniform block (as for DeferredLightProgram), the camera from the Frame block:
+struct SpotDecalProgram {
+	//opengl program object:
+	GLuint program = 0;
+
+	//uniform locations:
+	GLuint rect_vec4 = -1U; //rectangle covered, as (min x, min y, max x, max y) in world space
+	GLuint height_float = -1U; //...and its height (the floor's surface)
+	GLuint albedo_vec3 = -1U; //color of the floor, as far as the decal knows
+
+	SpotDecalProgram();
+};
+
+extern Load< SpotDecalProgram > spot_decal_program;
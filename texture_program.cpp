@@ -2,94 +2,190 @@
 
 #include "compile_program.hpp"
 #include "gl_errors.hpp"
+#include "Scene.hpp"
+#include "uniform_blocks.hpp"
+#include "light_tiles.hpp"
 
-TextureProgram::TextureProgram() {
-	program = compile_program(
-		"#version 330\n"
-		"uniform mat4 object_to_clip;\n"
-		"uniform mat4x3 object_to_light;\n"
-		"uniform mat3 normal_to_light;\n"
-		"uniform mat4 light_to_spot;\n"
-		"layout(location=0) in vec4 Position;\n" //note: layout keyword used to make sure that the location-0 attribute is always bound to something
-		"in vec3 Normal;\n"
-		"in vec4 Color;\n"
-		"in vec2 TexCoord;\n"
+#include <string>
+
+char const *texture_lighting_glsl =
+	"uniform sampler2DShadow spot_depth_tex;\n"
+	"uniform sampler2D wall_tex;\n"
+	//is the straight path from 'from' to 'to' clear of walls? (walks the cells of wall_tex it crosses, if wall_grid.x != 0):
+	"float grid_visibility(vec3 from, vec3 to) {\n"
+	"	if (wall_grid.x == 0.0) return 1.0;\n"
+	"	vec2 p = from.xy + 0.5;\n" //(cell (x,y) spans [x-0.5,x+0.5]; shift so that cells are floor(p))
+	"	vec2 d = to.xy - from.xy;\n"
+	"	ivec2 cell = ivec2(floor(p));\n"
+	"	ivec2 cell_step = ivec2(sign(d));\n"
+	"	vec2 t_delta = vec2(1e30);\n" //(path length, as a fraction of from-to, to cross one cell)
+	"	vec2 t_max = vec2(1e30);\n" //(...and to reach the next cell boundary)
+	"	if (cell_step.x != 0) {\n"
+	"		t_delta.x = 1.0 / abs(d.x);\n"
+	"		t_max.x = (cell_step.x > 0 ? float(cell.x + 1) - p.x : p.x - float(cell.x)) * t_delta.x;\n"
+	"	}\n"
+	"	if (cell_step.y != 0) {\n"
+	"		t_delta.y = 1.0 / abs(d.y);\n"
+	"		t_max.y = (cell_step.y > 0 ? float(cell.y + 1) - p.y : p.y - float(cell.y)) * t_delta.y;\n"
+	"	}\n"
+	"	float t = 0.0;\n"
+	"	for (int i = 0; i < 64; ++i) {\n"
+	"		float t_next = min(min(t_max.x, t_max.y), 1.0);\n"
+	"		if (all(greaterThanEqual(cell, ivec2(0))) && all(lessThan(cell, ivec2(wall_grid.xy)))\n"
+	"		 && texelFetch(wall_tex, cell, 0).r > 0.5) {\n"
+	//blocked if the path is within the wall's height while crossing its cell:
+	"			float z0 = mix(from.z, to.z, t);\n"
+	"			float z1 = mix(from.z, to.z, t_next);\n"
+	"			if (max(z0, z1) > wall_grid.z && min(z0, z1) < wall_grid.w) return 0.0;\n"
+	"		}\n"
+	"		if (t_next >= 1.0) break;\n"
+	"		if (t_max.x < t_max.y) {\n"
+	"			t = t_max.x; t_max.x += t_delta.x; cell.x += cell_step.x;\n"
+	"		} else {\n"
+	"			t = t_max.y; t_max.y += t_delta.y; cell.y += cell_step.y;\n"
+	"		}\n"
+	"	}\n"
+	"	return 1.0;\n"
+	"}\n"
+	"vec3 sky_and_sun_light(vec3 n) {\n"
+	"	vec3 total_light = vec3(0.0, 0.0, 0.0);\n"
+	"	{ //sky (hemisphere) light:\n"
+	"		vec3 l = sky_direction;\n"
+	"		float nl = 0.5 + 0.5 * dot(n,l);\n"
+	"		total_light += nl * sky_color;\n"
+	"	}\n"
+	"	{ //sun (directional) light:\n"
+	"		vec3 l = sun_direction;\n"
+	"		float nl = max(0.0, dot(n,l));\n"
+	"		total_light += nl * sun_color;\n"
+	"	}\n"
+	"	return total_light;\n"
+	"}\n"
+	//spot (point with fov + shadow map, unless 'shadowed' is zero) light; at_spot is 'at' in shadow map coordinates:
+	"vec3 spot_light(vec3 at, vec3 n, vec4 at_spot, vec3 spot_position, vec3 spot_direction, vec3 spot_color, vec2 spot_outer_inner, float shadowed) {\n"
+	"	vec3 dif = spot_position - at;\n"
+	"	float dist = length(dif);\n"
+	"	vec3 l = normalize(dif);\n"
+	"	float nl = max(0.0, dot(n,l));\n"
+	"	float d = dot(l,-spot_direction);\n"
+	"	float amt = smoothstep(spot_outer_inner.x, spot_outer_inner.y, d) / (1.0 + 0.4*dist + 0.8*dist*dist);\n"
+	"	if (amt <= 0.0) return vec3(0.0);\n" //(outside the cone; the shadow lookup could land in another light's part of the atlas)
+	"	float shadow = 1.0;\n"
+	"	if (shadowed != 0.0) {\n"
+	"		shadow = textureProj(spot_depth_tex, at_spot);\n"
+	"		if (shadow > 0.0) shadow *= grid_visibility(at + 0.01 * n, spot_position);\n" //(nudged off the surface, which may be a wall's)
+	"	}\n"
+	"	return shadow * nl * amt * spot_color;\n"
+	"}\n"
+;
+
+TextureProgram::TextureProgram(bool instanced, bool gbuffer) {
+	//per-object matrices are either uniforms or (instanced) per-instance attributes:
+	std::string object_matrices;
+	if (instanced) {
+		object_matrices =
+			"layout(location=" + std::to_string(Scene::InstanceObjectToClipLocation) + ") in mat4 object_to_clip;\n"
+			"layout(location=" + std::to_string(Scene::InstanceObjectToLightLocation) + ") in mat4x3 object_to_light;\n"
+			"layout(location=" + std::to_string(Scene::InstanceNormalToLightLocation) + ") in mat3 normal_to_light;\n"
+		;
+	} else {
+		object_matrices =
+			"uniform mat4 object_to_clip;\n"
+			"uniform mat4x3 object_to_light;\n"
+			"uniform mat3 normal_to_light;\n"
+		;
+	}
+
+	std::string vertex_outputs =
 		"out vec3 position;\n"
 		"out vec3 normal;\n"
 		"out vec4 color;\n"
 		"out vec2 texCoord;\n"
-		"out vec4 spotPosition;\n"
-		"void main() {\n"
-		"	gl_Position = object_to_clip * Position;\n"
-		"	position = object_to_light * Position;\n"
-		"	spotPosition = light_to_spot * vec4(position, 1.0);\n"
-		"	normal = normal_to_light * Normal;\n"
-		"	color = Color;\n"
-		"	texCoord = TexCoord;\n"
-		"}\n"
-		,
-		"#version 330\n"
-		"uniform vec3 sun_direction;\n"
-		"uniform vec3 sun_color;\n"
-		"uniform vec3 sky_direction;\n"
-		"uniform vec3 sky_color;\n"
-		"uniform vec3 spot_position;\n"
-		"uniform vec3 spot_direction;\n"
-		"uniform vec3 spot_color;\n"
-		"uniform vec2 spot_outer_inner;\n"
-		"uniform sampler2D tex;\n"
-		"uniform sampler2DShadow spot_depth_tex;\n"
+	;
+	std::string fragment_inputs =
 		"in vec3 position;\n"
 		"in vec3 normal;\n"
 		"in vec4 color;\n"
 		"in vec2 texCoord;\n"
-		"in vec4 spotPosition;\n"
-		"out vec4 fragColor;\n"
-		"void main() {\n"
-		"	vec3 total_light = vec3(0.0, 0.0, 0.0);\n"
-		"	vec3 n = normalize(normal);\n"
-		"	{ //sky (hemisphere) light:\n"
-		"		vec3 l = sky_direction;\n"
-		"		float nl = 0.5 + 0.5 * dot(n,l);\n"
-		"		total_light += nl * sky_color;\n"
-		"	}\n"
-		"	{ //sun (directional) light:\n"
-		"		vec3 l = sun_direction;\n"
-		"		float nl = max(0.0, dot(n,l));\n"
-		"		total_light += nl * sun_color;\n"
-		"	}\n"
-		"	{ //spot (point with fov + shadow map) light:\n"
-		"		vec3 dif = spot_position - position;\n"
-		"		float dist = length(dif);\n"
-		"		vec3 l = normalize(dif);\n"
-		"		float nl = max(0.0, dot(n,l));\n"
-		"		//TODO: look up shadow map\n"
-		"		float d = dot(l,-spot_direction);\n"
-		"		float amt = smoothstep(spot_outer_inner.x, spot_outer_inner.y, d) / (1.0 + 0.4*dist + 0.8*dist*dist);\n"
-		"		float shadow = textureProj(spot_depth_tex, spotPosition);\n"
-		"		total_light += shadow * nl * amt * spot_color;\n"
-		//"		fragColor = vec4(s,s,s, 1.0);\n" //DEBUG: just show shadow
-		"	}\n"
-
-		"	fragColor = texture(tex, texCoord) * vec4(color.rgb * total_light, color.a);\n"
-		"}\n"
-	);
+	;
+
+	if (gbuffer) {
+		//surface attributes only; lighting is done later, in screen space (see deferred_light_program):
+		program = compile_program(
+			"#version 330\n"
+			"invariant gl_Position;\n" //(depths must match depth_program's exactly for a depth pre-pass)
+			+ object_matrices +
+			"layout(location=0) in vec4 Position;\n"
+			"in vec3 Normal;\n"
+			"in vec4 Color;\n"
+			"in vec2 TexCoord;\n"
+			+ vertex_outputs +
+			"void main() {\n"
+			"	gl_Position = object_to_clip * Position;\n"
+			"	position = object_to_light * Position;\n"
+			"	normal = normal_to_light * Normal;\n"
+			"	color = Color;\n"
+			"	texCoord = TexCoord;\n"
+			"}\n"
+			,
+			"#version 330\n"
+			"uniform sampler2D tex;\n"
+			+ fragment_inputs +
+			"layout(location=0) out vec4 albedo;\n"
+			"layout(location=1) out vec3 surfaceNormal;\n"
+			"layout(location=2) out vec3 surfacePosition;\n"
+			"void main() {\n"
+			"	albedo = texture(tex, texCoord) * color;\n"
+			"	surfaceNormal = normalize(normal);\n"
+			"	surfacePosition = position;\n"
+			"}\n"
+		);
+	} else {
+		program = compile_program(
+			"#version 330\n"
+			"invariant gl_Position;\n" //(depths must match depth_program's exactly for a depth pre-pass)
+			+ object_matrices +
+			"layout(location=0) in vec4 Position;\n" //note: layout keyword used to make sure that the location-0 attribute is always bound to something
+			"in vec3 Normal;\n"
+			"in vec4 Color;\n"
+			"in vec2 TexCoord;\n"
+			+ vertex_outputs +
+			"void main() {\n"
+			"	gl_Position = object_to_clip * Position;\n"
+			"	position = object_to_light * Position;\n"
+			"	normal = normal_to_light * Normal;\n"
+			"	color = Color;\n"
+			"	texCoord = TexCoord;\n"
+			"}\n"
+			,
+			"#version 330\n"
+			+ std::string(frame_block_glsl)
+			+ spots_block_glsl
+			+ texture_lighting_glsl +
+			"uniform sampler2D tex;\n"
+			"uniform usampler2D spot_tiles_tex;\n"
+			+ fragment_inputs +
+			"out vec4 fragColor;\n"
+			"void main() {\n"
+			"	vec3 n = normalize(normal);\n"
+			"	vec3 total_light = sky_and_sun_light(n);\n"
+			//only the spots that LightTiles says can reach this part of the screen:
+			"	uint mask = texelFetch(spot_tiles_tex, ivec2(gl_FragCoord.xy) / " + std::to_string(LightTiles::TileSize) + ", 0).r;\n"
+			"	for (int i = 0; i < spot_count; ++i) {\n"
+			"		if ((mask & (1u << uint(i))) == 0u) continue;\n"
+			"		vec4 at_spot = spots[i].light_to_spot * vec4(position, 1.0);\n"
+			"		total_light += spot_light(position, n, at_spot, spots[i].position, spots[i].direction, spots[i].color, spots[i].outer_inner, spots[i].shadowed);\n"
+			"	}\n"
+			"	fragColor = texture(tex, texCoord) * vec4(color.rgb * total_light, color.a);\n"
+			"}\n"
+		);
+	}
 
 	object_to_clip_mat4 = glGetUniformLocation(program, "object_to_clip");
 	object_to_light_mat4x3 = glGetUniformLocation(program, "object_to_light");
 	normal_to_light_mat3 = glGetUniformLocation(program, "normal_to_light");
 
-	sun_direction_vec3 = glGetUniformLocation(program, "sun_direction");
-	sun_color_vec3 = glGetUniformLocation(program, "sun_color");
-	sky_direction_vec3 = glGetUniformLocation(program, "sky_direction");
-	sky_color_vec3 = glGetUniformLocation(program, "sky_color");
-
-	spot_position_vec3 = glGetUniformLocation(program, "spot_position");
-	spot_direction_vec3 = glGetUniformLocation(program, "spot_direction");
-	spot_color_vec3 = glGetUniformLocation(program, "spot_color");
-	spot_outer_inner_vec2 = glGetUniformLocation(program, "spot_outer_inner");
-
-	light_to_spot_mat4 = glGetUniformLocation(program, "light_to_spot");
+	bind_uniform_blocks(program);
 
 	glUseProgram(program);
 
@@ -99,6 +195,12 @@ TextureProgram::TextureProgram() {
 	GLuint spot_depth_tex_sampler2D = glGetUniformLocation(program, "spot_depth_tex");
 	glUniform1i(spot_depth_tex_sampler2D, 1);
 
+	GLuint spot_tiles_tex_usampler2D = glGetUniformLocation(program, "spot_tiles_tex");
+	glUniform1i(spot_tiles_tex_usampler2D, 2);
+
+	GLuint wall_tex_sampler2D = glGetUniformLocation(program, "wall_tex");
+	glUniform1i(wall_tex_sampler2D, 4);
+
 	glUseProgram(0);
 
 	GL_ERRORS();
@@ -107,3 +209,15 @@ TextureProgram::TextureProgram() {
 Load< TextureProgram > texture_program(LoadTagInit, [](){
 	return new TextureProgram();
 });
+
+Load< TextureProgram > texture_program_instanced(LoadTagInit, [](){
+	return new TextureProgram(true);
+});
+
+Load< TextureProgram > texture_program_gbuffer(LoadTagInit, [](){
+	return new TextureProgram(false, true);
+});
+
+Load< TextureProgram > texture_program_gbuffer_instanced(LoadTagInit, [](){
+	return new TextureProgram(true, true);
+});
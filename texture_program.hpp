@@ -1,7 +1,8 @@
 #include "GL.hpp"
 #include "Load.hpp"
 
-//TextureProgram draws a surface lit by two lights (a distant directional and a hemispherical light) where the surface color is drawn from texture unit 0:
+//TextureProgram draws a surface lit by a distant directional light, a hemispherical light, and any number of shadowed spot lights,
+// where the surface color is drawn from texture unit 0:
 struct TextureProgram {
 	//opengl program object:
 	GLuint program = 0;
@@ -11,22 +12,27 @@ struct TextureProgram {
 	GLuint object_to_light_mat4x3 = -1U;
 	GLuint normal_to_light_mat3 = -1U;
 
-	GLuint sun_direction_vec3 = -1U; //direction *to* sun
-	GLuint sun_color_vec3 = -1U;
-	GLuint sky_direction_vec3 = -1U; //direction *to* sky
-	GLuint sky_color_vec3 = -1U;
-
-	GLuint spot_position_vec3 = -1U;
-	GLuint spot_direction_vec3 = -1U; //direction *from* spotlight
-	GLuint spot_color_vec3 = -1U;
-	GLuint spot_outer_inner_vec2 = -1U; //color fades from zero to one as dot(spot_direction, spot_to_position) varies from outer_inner.x to outer_inner.y
-	GLuint light_to_spot_mat4 = -1U; //projects from lighting space (/world space) to spot light depth map space
+	//lighting and camera constants come from the Frame and Spots uniform blocks (see uniform_blocks.hpp)
 
 	//textures:
 	//texture0 - texture for the surface
-	//texture1 - texture for spot light shadow map
+	//texture1 - shadow atlas (each spot's light_to_spot maps into its own part)
+	//texture2 - which spots reach each screen tile (see LightTiles)
+	//texture4 - walls (for grid shadows; see texture_lighting_glsl)
 
-	TextureProgram();
+	//if 'instanced', object_to_clip, object_to_light, and normal_to_light are per-instance attributes
+	// (at the locations given by Scene::Instance*Location) rather than uniforms
+	//if 'gbuffer', no lighting is done; instead the program writes surface color (texture0 times vertex color),
+	// normal, and position (in lighting space) to color attachments 0, 1, and 2 for deferred lighting:
+	TextureProgram(bool instanced = false, bool gbuffer = false);
 };
 
+//GLSL for the program's lighting: declares the spot_depth_tex sampler, 'vec3 sky_and_sun_light(normal)',
+// and 'vec3 spot_light(position, normal, position_in_shadow_map, spot position, direction, color, outer_inner)'
+// (requires the Frame block to be declared first; shared with deferred lighting, so both paths light surfaces identically)
+extern char const *texture_lighting_glsl;
+
 extern Load< TextureProgram > texture_program;
+extern Load< TextureProgram > texture_program_instanced;
+extern Load< TextureProgram > texture_program_gbuffer;
+extern Load< TextureProgram > texture_program_gbuffer_instanced;
@@ -0,0 +1,115 @@
+#include "uniform_blocks.hpp"
+
+#include "gl_errors.hpp"
+
+#include <cassert>
+
+char const *frame_block_glsl =
+	"layout(std140) uniform Frame {\n"
+	"	mat4 world_to_clip;\n"
+	"	vec3 eye_position;\n"
+	"	vec3 sun_direction;\n"
+	"	vec3 sun_color;\n"
+	"	vec3 sky_direction;\n"
+	"	vec3 sky_color;\n"
+	"	vec4 wall_grid;\n"
+	"};\n"
+;
+
+char const *light_block_glsl =
+	"layout(std140) uniform Light {\n"
+	"	mat4 light_to_spot;\n"
+	"	vec3 spot_position;\n"
+	"	float spot_shadowed;\n"
+	"	vec3 spot_direction;\n"
+	"	vec3 spot_color;\n"
+	"	float ambient;\n"
+	"	vec2 spot_outer_inner;\n"
+	"};\n"
+;
+
+char const *spots_block_glsl =
+	"struct Spot {\n"
+	"	mat4 light_to_spot;\n"
+	"	vec3 position;\n"
+	"	float shadowed;\n"
+	"	vec3 direction;\n"
+	"	vec3 color;\n"
+	"	vec2 outer_inner;\n"
+	"};\n"
+	"layout(std140) uniform Spots {\n"
+	"	Spot spots[16];\n" //SpotsBlock::MaxSpots
+	"	int spot_count;\n"
+	"};\n"
+;
+
+void bind_uniform_blocks(GLuint program) {
+	GLuint frame_index = glGetUniformBlockIndex(program, "Frame");
+	if (frame_index != GL_INVALID_INDEX) glUniformBlockBinding(program, frame_index, FrameBinding);
+	GLuint light_index = glGetUniformBlockIndex(program, "Light");
+	if (light_index != GL_INVALID_INDEX) glUniformBlockBinding(program, light_index, LightBinding);
+	GLuint spots_index = glGetUniformBlockIndex(program, "Spots");
+	if (spots_index != GL_INVALID_INDEX) glUniformBlockBinding(program, spots_index, SpotsBinding);
+}
+
+UniformRing uniform_ring;
+
+UniformRing::UniformRing(uint32_t buffer_count_, GLsizeiptr buffer_size_) : buffer_count(buffer_count_), buffer_size(buffer_size_) {
+	assert(buffer_count > 0);
+}
+
+void UniformRing::begin_frame() {
+	current = (current + 1) % buffer_count;
+	offset = 0;
+	//(blocks bound in earlier frames live in other buffers, which push() never orphans)
+	for (std::vector< char > &block : frame_blocks) block.clear();
+}
+
+void UniformRing::push(GLuint binding, void const *data, GLsizeiptr size) {
+	assert(size <= buffer_size && "Uniform block must fit in a ring buffer.");
+
+	if (buffers.empty()) {
+		//(allocated here rather than in the constructor because the GL context doesn't exist yet at static init)
+		buffers.resize(buffer_count, 0);
+		glGenBuffers(buffer_count, buffers.data());
+		for (GLuint buffer : buffers) {
+			glBindBuffer(GL_UNIFORM_BUFFER, buffer);
+			glBufferData(GL_UNIFORM_BUFFER, buffer_size, NULL, GL_DYNAMIC_DRAW);
+		}
+		glBindBuffer(GL_UNIFORM_BUFFER, 0);
+		glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &alignment);
+		if (alignment < 1) alignment = 1;
+		GL_ERRORS();
+	}
+
+	if (frame_blocks.size() <= binding) frame_blocks.resize(binding + 1);
+
+	glBindBuffer(GL_UNIFORM_BUFFER, buffers[current]);
+
+	auto write = [this](GLuint binding, void const *data, GLsizeiptr size) {
+		//ranges must start at a multiple of the alignment:
+		offset = (offset + alignment - 1) / alignment * alignment;
+		glBufferSubData(GL_UNIFORM_BUFFER, offset, size, data);
+		glBindBufferRange(GL_UNIFORM_BUFFER, binding, buffers[current], offset, size);
+		offset += size;
+	};
+
+	if ((offset + alignment - 1) / alignment * alignment + size > buffer_size) {
+		//Out of room in this frame's buffer. The GPU may still be reading blocks from it (and from the other buffers),
+		// so orphan its storage -- the driver keeps the old store until those reads are done -- and carry on in a fresh one.
+		//Blocks bound from it earlier this frame (e.g., Frame and Spots) would then read the fresh, empty store, so write them again:
+		glBufferData(GL_UNIFORM_BUFFER, buffer_size, NULL, GL_DYNAMIC_DRAW);
+		offset = 0;
+		for (GLuint b = 0; b < frame_blocks.size(); ++b) {
+			if (b == binding || frame_blocks[b].empty()) continue;
+			write(b, frame_blocks[b].data(), GLsizeiptr(frame_blocks[b].size()));
+		}
+		assert((offset + alignment - 1) / alignment * alignment + size <= buffer_size && "A frame's uniform blocks (one per binding) must fit in a ring buffer.");
+	}
+
+	write(binding, data, size);
+	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+
+	char const *bytes = reinterpret_cast< char const * >(data);
+	frame_blocks[binding].assign(bytes, bytes + size);
+}
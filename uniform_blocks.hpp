@@ -0,0 +1,105 @@
+#pragma once
+
+#include "GL.hpp"
+
+#include <glm/glm.hpp>
+
+#include <vector>
+
+//Camera and lighting constants shared by all programs through std140 uniform blocks.
+// (in std140, a vec3 takes a whole vec4 slot unless followed by a float, hence the padding below)
+
+//binding points for the blocks:
+enum : GLuint {
+	FrameBinding = 0,
+	LightBinding = 1,
+	SpotsBinding = 2,
+};
+
+//"Frame" -- constants for the whole frame:
+struct FrameBlock {
+	glm::mat4 world_to_clip = glm::mat4(1.0f); //main camera
+	glm::vec3 eye_position = glm::vec3(0.0f); //main camera position (world space)
+	float pad0 = 0.0f;
+	glm::vec3 sun_direction = glm::vec3(0.0f, 0.0f, 1.0f); //direction *to* sun
+	float pad1 = 0.0f;
+	glm::vec3 sun_color = glm::vec3(0.0f);
+	float pad2 = 0.0f;
+	glm::vec3 sky_direction = glm::vec3(0.0f, 0.0f, 1.0f); //direction *to* sky
+	float pad3 = 0.0f;
+	glm::vec3 sky_color = glm::vec3(0.0f);
+	float pad4 = 0.0f;
+	glm::vec4 wall_grid = glm::vec4(0.0f); //(for grid shadows) grid size in cells (or 0 if off), then bottom and top of walls
+};
+static_assert(sizeof(FrameBlock) == 4*16 + 6*4*4, "FrameBlock matches std140 layout.");
+
+//"Light" -- constants for one lighting pass:
+struct LightBlock {
+	glm::mat4 light_to_spot = glm::mat4(1.0f); //projects from lighting space (/world space) to spot light depth map space
+	glm::vec3 spot_position = glm::vec3(0.0f);
+	float spot_shadowed = 1.0f; //0 for a spot lit without a shadow map (light_to_spot is then unused)
+	glm::vec3 spot_direction = glm::vec3(0.0f, 0.0f, -1.0f); //direction *from* spotlight
+	float pad1 = 0.0f;
+	glm::vec3 spot_color = glm::vec3(0.0f);
+	float ambient = 0.0f; //scales the sun and sky light from the Frame block (so they are only added in one pass)
+	glm::vec2 spot_outer_inner = glm::vec2(0.0f, 1.0f); //color fades from zero to one as dot(spot_direction, spot_to_position) varies from outer_inner.x to outer_inner.y
+	glm::vec2 pad2 = glm::vec2(0.0f);
+};
+static_assert(sizeof(LightBlock) == 4*16 + 4*4*4, "LightBlock matches std140 layout.");
+
+//"Spots" -- all the spot lights of a frame, for programs that light a surface with several at once:
+struct SpotsBlock {
+	enum : uint32_t { MaxSpots = 16 };
+	struct Spot {
+		glm::mat4 light_to_spot = glm::mat4(1.0f); //lighting space to this spot's rectangle of the shadow atlas
+		glm::vec3 position = glm::vec3(0.0f);
+		float shadowed = 1.0f; //as in LightBlock::spot_shadowed
+		glm::vec3 direction = glm::vec3(0.0f, 0.0f, -1.0f); //direction *from* spotlight
+		float pad1 = 0.0f;
+		glm::vec3 color = glm::vec3(0.0f);
+		float pad2 = 0.0f;
+		glm::vec2 outer_inner = glm::vec2(0.0f, 1.0f); //as in LightBlock::spot_outer_inner
+		glm::vec2 pad3 = glm::vec2(0.0f);
+	} spots[MaxSpots];
+	int32_t spot_count = 0;
+	int32_t pad0[3] = {0,0,0};
+};
+static_assert(sizeof(SpotsBlock::Spot) == 4*16 + 4*4*4, "SpotsBlock::Spot matches std140 layout.");
+static_assert(sizeof(SpotsBlock) == SpotsBlock::MaxSpots * sizeof(SpotsBlock::Spot) + 4*4, "SpotsBlock matches std140 layout.");
+
+//GLSL declarations of the blocks (to paste into shader source):
+extern char const *frame_block_glsl;
+extern char const *light_block_glsl;
+extern char const *spots_block_glsl;
+
+//connect a program's Frame, Light, and Spots blocks (whichever it declares) to their binding points:
+void bind_uniform_blocks(GLuint program);
+
+//"UniformRing" streams uniform blocks to the GPU through a ring of buffers:
+// - push() writes a block with one glBufferSubData and binds just that range of the buffer to a binding point
+// - begin_frame() moves on to the next buffer, so writes don't have to wait for the GPU to finish reading older ones
+// - a frame that fills its buffer orphans it (glBufferData with no data) and carries on in fresh storage,
+//   writing again the latest block of each binding pushed earlier in the frame, so those bindings stay valid
+struct UniformRing {
+	UniformRing(uint32_t buffer_count = 3, GLsizeiptr buffer_size = 16 * 1024);
+
+	void begin_frame();
+
+	template< typename T >
+	void push(GLuint binding, T const &block) {
+		push(binding, &block, sizeof(T));
+	}
+	void push(GLuint binding, void const *data, GLsizeiptr size);
+
+	//internals:
+	std::vector< GLuint > buffers; //allocated on first use
+	uint32_t buffer_count;
+	GLsizeiptr buffer_size;
+	uint32_t current = 0; //buffer being written
+	GLintptr offset = 0; //next free byte in current buffer
+	GLint alignment = 0; //GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT
+	std::vector< std::vector< char > > frame_blocks; //per binding, the block last pushed this frame (empty if none)
+};
+
+//used by all programs:
+extern UniformRing uniform_ring;
@@ -1,6 +1,9 @@
 #include "vertex_color_program.hpp"
 
 #include "compile_program.hpp"
+#include "uniform_blocks.hpp"
+
+#include <string>
 
 VertexColorProgram::VertexColorProgram() {
 	program = compile_program(
@@ -22,10 +25,7 @@ VertexColorProgram::VertexColorProgram() {
 		"}\n"
 		,
 		"#version 330\n"
-		"uniform vec3 sun_direction;\n"
-		"uniform vec3 sun_color;\n"
-		"uniform vec3 sky_direction;\n"
-		"uniform vec3 sky_color;\n"
+		+ std::string(frame_block_glsl) +
 		"in vec3 position;\n"
 		"in vec3 normal;\n"
 		"in vec4 color;\n"
@@ -51,10 +51,7 @@ VertexColorProgram::VertexColorProgram() {
 	object_to_light_mat4x3 = glGetUniformLocation(program, "object_to_light");
 	normal_to_light_mat3 = glGetUniformLocation(program, "normal_to_light");
 
-	sun_direction_vec3 = glGetUniformLocation(program, "sun_direction");
-	sun_color_vec3 = glGetUniformLocation(program, "sun_color");
-	sky_direction_vec3 = glGetUniformLocation(program, "sky_direction");
-	sky_color_vec3 = glGetUniformLocation(program, "sky_color");
+	bind_uniform_blocks(program);
 }
 
 Load< VertexColorProgram > vertex_color_program(LoadTagInit, [](){
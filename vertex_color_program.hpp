@@ -9,10 +9,7 @@ struct VertexColorProgram {
 	GLuint object_to_clip_mat4 = -1U;
 	GLuint object_to_light_mat4x3 = -1U;
 	GLuint normal_to_light_mat3 = -1U;
-	GLuint sun_direction_vec3 = -1U;
-	GLuint sun_color_vec3 = -1U;
-	GLuint sky_direction_vec3 = -1U;
-	GLuint sky_color_vec3 = -1U;
+	//sun and sky come from the Frame uniform block (see uniform_blocks.hpp)
 
 	VertexColorProgram();
 };
@@ -0,0 +1,215 @@
+#include "visibility.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <cassert>
+
+namespace {
+	const float TwoPi = 6.28318530718f;
+	const float MaxArcStep = 0.0873f; //(5 degrees; see VisibilityGrid::compute)
+	const float CornerEpsilon = 1e-4f; //(rays are cast this far to either side of each wall corner, to see past it)
+
+	//angle of 'v' counter-clockwise from angle 'start', in [0, 2pi):
+	float angle_from(float start, glm::vec2 const &v) {
+		float a = std::atan2(v.y, v.x) - start;
+		a -= TwoPi * std::floor(a / TwoPi);
+		return (a >= TwoPi ? 0.0f : a);
+	}
+}
+
+bool VisibilityPolygon::contains(glm::vec2 const &p) const {
+	if (points.size() < 2) return false;
+	glm::vec2 v = p - origin;
+	if (glm::dot(v, v) > range * range) return false;
+	float a = angle_from(start, v);
+	if (a > span) return false;
+
+	//the fan triangle whose wedge holds 'p':
+	size_t i = std::upper_bound(angles.begin(), angles.end(), a) - angles.begin();
+	i = std::min(std::max(i, size_t(1)), points.size() - 1) - 1;
+
+	//...which holds 'p' if 'p' is on origin's side of the outer edge:
+	glm::vec2 e = points[i+1] - points[i];
+	glm::vec2 w = p - points[i];
+	return e.x * w.y - e.y * w.x >= 0.0f;
+}
+
+void VisibilityPolygon::extrude_walls(float bottom, float top, std::vector< glm::vec3 > *triangles) const {
+	assert(triangles);
+	for (size_t i = 0; i + 1 < points.size(); ++i) {
+		if (!on_wall[i] || !on_wall[i+1]) continue;
+		//(edges that step past a corner run straight away from origin, so a lamp there sees their quads edge-on)
+		glm::vec2 const &a = points[i];
+		glm::vec2 const &b = points[i+1];
+		triangles->emplace_back(a, bottom);
+		triangles->emplace_back(b, bottom);
+		triangles->emplace_back(b, top);
+		triangles->emplace_back(a, bottom);
+		triangles->emplace_back(b, top);
+		triangles->emplace_back(a, top);
+	}
+}
+
+void VisibilityGrid::set_walls(glm::uvec2 size_, std::function< bool(uint32_t x, uint32_t y) > const &is_wall) {
+	size = size_;
+	walls.assign(size.x * size.y, 0);
+	for (uint32_t y = 0; y < size.y; ++y) {
+		for (uint32_t x = 0; x < size.x; ++x) {
+			walls[y * size.x + x] = (is_wall(x, y) ? 1 : 0);
+		}
+	}
+	cache.clear();
+}
+
+float VisibilityGrid::cast(glm::vec2 const &from, glm::vec2 const &dir, float max_distance) const {
+	//walk the cells the ray crosses (cells are floor(p) once shifted by half a cell):
+	glm::vec2 p = from + 0.5f;
+	glm::ivec2 cell = glm::ivec2(glm::floor(p));
+	if (is_wall(cell.x, cell.y)) return 0.0f;
+
+	glm::ivec2 step = glm::ivec2(dir.x > 0.0f ? 1 : -1, dir.y > 0.0f ? 1 : -1);
+	glm::vec2 t_delta(std::numeric_limits< float >::infinity()); //(distance to cross one cell)
+	glm::vec2 t_max(std::numeric_limits< float >::infinity()); //(...and to reach the next cell boundary)
+	if (dir.x != 0.0f) {
+		t_delta.x = 1.0f / std::abs(dir.x);
+		t_max.x = (step.x > 0 ? float(cell.x + 1) - p.x : p.x - float(cell.x)) * t_delta.x;
+	}
+	if (dir.y != 0.0f) {
+		t_delta.y = 1.0f / std::abs(dir.y);
+		t_max.y = (step.y > 0 ? float(cell.y + 1) - p.y : p.y - float(cell.y)) * t_delta.y;
+	}
+
+	while (true) {
+		float t;
+		if (t_max.x < t_max.y) {
+			t = t_max.x;
+			t_max.x += t_delta.x;
+			cell.x += step.x;
+		} else {
+			t = t_max.y;
+			t_max.y += t_delta.y;
+			cell.y += step.y;
+		}
+		if (t >= max_distance) return max_distance;
+		if (is_wall(cell.x, cell.y)) return t;
+	}
+}
+
+void VisibilityGrid::compute(glm::vec2 const &origin, float direction, float half_angle, float range, VisibilityPolygon *polygon_) const {
+	assert(polygon_);
+	auto &polygon = *polygon_;
+	polygon.origin = origin;
+	polygon.span = std::min(2.0f * half_angle, TwoPi);
+	polygon.start = direction - 0.5f * polygon.span;
+	polygon.range = range;
+	polygon.points.clear();
+	polygon.angles.clear();
+	polygon.on_wall.clear();
+
+	glm::ivec2 origin_cell = glm::ivec2(glm::floor(origin + 0.5f));
+	if (is_wall(origin_cell.x, origin_cell.y)) return;
+
+	//the boundary only changes what it follows at wall corners and where walls meet the range limit, so rays are cast:
+	std::vector< float > &angles = polygon.angles;
+	// - at the cone's edges and along the range limit:
+	uint32_t arc_steps = std::max(1U, uint32_t(std::ceil(polygon.span / MaxArcStep)));
+	for (uint32_t s = 0; s <= arc_steps; ++s) {
+		angles.emplace_back(polygon.span * float(s) / float(arc_steps));
+	}
+	// - at (and just to either side of) each corner where walls meet open cells, in range:
+	glm::ivec2 min = glm::ivec2(glm::floor(origin - range)) - 1;
+	glm::ivec2 max = glm::ivec2(glm::ceil(origin + range)) + 1;
+	for (int32_t cy = min.y; cy <= max.y; ++cy) {
+		for (int32_t cx = min.x; cx <= max.x; ++cx) {
+			//corner (cx+0.5, cy+0.5) is shared by cells (cx,cy), (cx+1,cy), (cx,cy+1), (cx+1,cy+1):
+			bool w00 = is_wall(cx, cy);
+			bool w10 = is_wall(cx + 1, cy);
+			bool w01 = is_wall(cx, cy + 1);
+			bool w11 = is_wall(cx + 1, cy + 1);
+			uint32_t count = uint32_t(w00) + uint32_t(w10) + uint32_t(w01) + uint32_t(w11);
+			if (count == 0 || count == 4) continue;
+			if (count == 2 && w00 != w11) continue; //(the middle of a straight wall)
+
+			glm::vec2 v = glm::vec2(cx + 0.5f, cy + 0.5f) - origin;
+			if (glm::dot(v, v) > range * range) continue;
+			float a = angle_from(polygon.start, v);
+			if (a > polygon.span) continue;
+			angles.emplace_back(std::max(0.0f, a - CornerEpsilon));
+			angles.emplace_back(a);
+			angles.emplace_back(std::min(polygon.span, a + CornerEpsilon));
+		}
+	}
+	// - (and to either side of) where wall faces cross the range limit:
+	auto add_crossing = [&](glm::vec2 const &at) {
+		float a = angle_from(polygon.start, at - origin);
+		if (a > polygon.span) return;
+		angles.emplace_back(std::max(0.0f, a - CornerEpsilon));
+		angles.emplace_back(std::min(polygon.span, a + CornerEpsilon));
+	};
+	for (int32_t c = min.x; c <= max.x; ++c) {
+		//faces along x = c+0.5, between cells c and c+1:
+		float dx = c + 0.5f - origin.x;
+		if (dx * dx >= range * range) continue;
+		float dy = std::sqrt(range * range - dx * dx);
+		for (float y : {origin.y - dy, origin.y + dy}) {
+			int32_t cy = int32_t(std::floor(y + 0.5f));
+			if (is_wall(c, cy) != is_wall(c + 1, cy)) add_crossing(glm::vec2(c + 0.5f, y));
+		}
+	}
+	for (int32_t c = min.y; c <= max.y; ++c) {
+		//faces along y = c+0.5, between cells c and c+1:
+		float dy = c + 0.5f - origin.y;
+		if (dy * dy >= range * range) continue;
+		float dx = std::sqrt(range * range - dy * dy);
+		for (float x : {origin.x - dx, origin.x + dx}) {
+			int32_t cx = int32_t(std::floor(x + 0.5f));
+			if (is_wall(cx, c) != is_wall(cx, c + 1)) add_crossing(glm::vec2(x, c + 0.5f));
+		}
+	}
+
+	std::sort(angles.begin(), angles.end());
+	angles.erase(std::unique(angles.begin(), angles.end()), angles.end());
+
+	polygon.points.reserve(angles.size());
+	polygon.on_wall.reserve(angles.size());
+	for (float a : angles) {
+		glm::vec2 dir = glm::vec2(std::cos(polygon.start + a), std::sin(polygon.start + a));
+		float t = cast(origin, dir, range);
+		polygon.points.emplace_back(origin + dir * t);
+		polygon.on_wall.emplace_back(t < range ? 1 : 0);
+	}
+}
+
+size_t VisibilityGrid::KeyHash::operator()(Key const &key) const {
+	size_t h = std::hash< int32_t >()(key.x);
+	h = h * 31 + std::hash< int32_t >()(key.y);
+	h = h * 31 + std::hash< uint32_t >()(key.direction);
+	h = h * 31 + std::hash< float >()(key.half_angle);
+	h = h * 31 + std::hash< float >()(key.range);
+	return h;
+}
+
+VisibilityPolygon const &VisibilityGrid::lookup(glm::vec2 const &origin, float direction, float half_angle, float range) {
+	Key key;
+	key.x = int32_t(std::floor(origin.x * OriginSteps));
+	key.y = int32_t(std::floor(origin.y * OriginSteps));
+	float turns = direction / TwoPi;
+	key.direction = uint32_t(int32_t(std::round((turns - std::floor(turns)) * DirectionSteps))) % DirectionSteps;
+	key.half_angle = half_angle;
+	key.range = range;
+
+	auto f = cache.find(key);
+	if (f != cache.end()) return f->second;
+
+	if (cache.size() >= MaxCached) cache.clear();
+	VisibilityPolygon &polygon = cache[key];
+	//(computed from the middle of the origin's step, so that it never lands exactly on a wall face)
+	compute(
+		(glm::vec2(key.x, key.y) + 0.5f) / float(OriginSteps),
+		key.direction * (TwoPi / DirectionSteps),
+		half_angle, range,
+		&polygon
+	);
+	return polygon;
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <glm/glm.hpp>
+
+#include <vector>
+#include <unordered_map>
+#include <functional>
+#include <cstdint>
+
+//"VisibilityPolygon" is the part of the plane seen from 'origin' within a cone and range, past the walls of a VisibilityGrid.
+// It is star-shaped around origin: its boundary is a list of points in increasing angle, so a fan from origin covers it.
+struct VisibilityPolygon {
+	glm::vec2 origin = glm::vec2(0.0f);
+	float start = 0.0f; //angle (radians, from +x toward +y) where the cone starts...
+	float span = 0.0f; //...and how far it turns (counter-clockwise)
+	float range = 0.0f;
+
+	//boundary, from the cone's start to its end (empty if origin is inside a wall):
+	std::vector< glm::vec2 > points;
+	std::vector< float > angles; //angle of each point, relative to start (increasing)
+	std::vector< uint8_t > on_wall; //is the point on a wall face? (otherwise it is at the range limit)
+
+	//is 'p' inside? (binary search over angles, so O(log n) in the number of points):
+	bool contains(glm::vec2 const &p) const;
+
+	//append the boundary edges lying on wall faces, as vertical quads (two triangles each) from z = bottom to top:
+	// (the wall faces a lamp at origin sees; for a lamp between bottom and top, drawing just these into its shadow map
+	//  shadows the same places as drawing every wall, since a ray that clears the nearest wall clears the rest)
+	void extrude_walls(float bottom, float top, std::vector< glm::vec3 > *triangles) const;
+};
+
+//"VisibilityGrid" finds visibility polygons against a grid of wall cells, cell (x,y) spanning [x-0.5,x+0.5] x [y-0.5,y+0.5].
+// Cells outside the grid count as walls.
+struct VisibilityGrid {
+	glm::uvec2 size = glm::uvec2(0);
+	std::vector< uint8_t > walls; //size.x * size.y, row-major in y
+
+	//(also empties the cache)
+	void set_walls(glm::uvec2 size, std::function< bool(uint32_t x, uint32_t y) > const &is_wall);
+	bool is_wall(int32_t x, int32_t y) const {
+		if (x < 0 || y < 0 || uint32_t(x) >= size.x || uint32_t(y) >= size.y) return true;
+		return walls[y * size.x + x] != 0;
+	}
+
+	//distance from 'from' along (unit) 'dir' to the first wall face, or max_distance if there isn't one before that:
+	float cast(glm::vec2 const &from, glm::vec2 const &dir, float max_distance) const;
+
+	//polygon seen from 'origin' in the cone 'direction' +/- half_angle (radians), out to 'range':
+	// (exact, except that the range limit is followed by chords of at most 5 degrees)
+	void compute(glm::vec2 const &origin, float direction, float half_angle, float range, VisibilityPolygon *polygon) const;
+
+	//as compute(), but kept per cell and orientation -- origin rounded to 1/OriginSteps of a cell, direction to 1/DirectionSteps of a turn:
+	// (the returned reference stays valid until the next lookup or set_walls)
+	VisibilityPolygon const &lookup(glm::vec2 const &origin, float direction, float half_angle, float range);
+	enum : uint32_t {
+		OriginSteps = 8,
+		DirectionSteps = 256,
+		MaxCached = 4096, //(the cache is emptied when it grows past this)
+	};
+
+	//------ internals ------
+	struct Key {
+		int32_t x, y; //origin, in 1/OriginSteps of a cell
+		uint32_t direction; //in 1/DirectionSteps of a turn
+		float half_angle, range;
+		bool operator==(Key const &o) const {
+			return x == o.x && y == o.y && direction == o.direction && half_angle == o.half_angle && range == o.range;
+		}
+	};
+	struct KeyHash {
+		size_t operator()(Key const &key) const;
+	};
+	std::unordered_map< Key, VisibilityPolygon, KeyHash > cache;
+};